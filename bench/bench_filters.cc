@@ -0,0 +1,294 @@
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+using namespace std;
+
+/* synopsis: bench_filters [-d filter dir] [-m large corpus MiB] [-r runs]
+                           [-k corpus dir]
+   Run every filter over every corpus, from a file argument and through a
+   pipe, and print a JSON array with one object per filter, corpus and
+   input kind. */
+
+// reproducible byte source (xorshift64*)
+struct Rng {
+    uint64_t s;
+    explicit Rng(uint64_t seed) : s(seed) {}
+    uint64_t next() {
+        s ^= s >> 12, s ^= s << 25, s ^= s >> 27;
+        return s * 2685821657736338717ULL;
+    }
+    size_t below(size_t n) { return next() % n; }
+};
+
+void word(string &out, Rng &rng) {
+    size_t n = 1 + rng.below(10);
+    while (n--) out += 'a' + rng.below(26);
+}
+
+void tag(string &out, Rng &rng, bool legal) {
+    out += '<';
+    if (rng.below(4) == 0) out += '/';
+    word(out, rng);
+    if (!legal) {
+        // attributes, digits or an unclosed '<' inside the tag
+        static const char *junk[] = {" id=\"x1\"", "1", " <", "-", " a b"};
+        out += junk[rng.below(5)];
+    }
+    out += '>';
+}
+
+/* corpus shapes
+   mixed: html-like text, about one tag per five words
+   tags: almost only tags
+   text: no brackets at all
+   long_lines: 1 MiB lines
+   empty_lines: mostly bare newlines
+   malformed: every other tag fails removetag0's check */
+string generate(const string &shape, size_t size, uint64_t seed) {
+    Rng rng(seed);
+    string out;
+    out.reserve(size + 64);
+    while (out.size() < size) {
+        if (shape == "mixed") {
+            if (rng.below(5) == 0) tag(out, rng, true);
+            word(out, rng);
+            out += rng.below(12) == 0 ? '\n' : ' ';
+        } else if (shape == "tags") {
+            tag(out, rng, true);
+            if (rng.below(16) == 0) out += '\n';
+        } else if (shape == "text") {
+            word(out, rng);
+            out += rng.below(12) == 0 ? '\n' : ' ';
+        } else if (shape == "long_lines") {
+            const size_t end = out.size() + (1 << 20);
+            while (out.size() < end) {
+                if (rng.below(8) == 0) tag(out, rng, true);
+                word(out, rng);
+                out += ' ';
+            }
+            out += '\n';
+        } else if (shape == "empty_lines") {
+            if (rng.below(16) == 0) word(out, rng);
+            out += '\n';
+        } else if (shape == "malformed") {
+            tag(out, rng, rng.below(2) == 0);
+            word(out, rng);
+            out += rng.below(8) == 0 ? '\n' : ' ';
+        }
+    }
+    out.resize(size);
+    return out;
+}
+
+struct Corpus {
+    string name, path;
+    size_t size;
+};
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int open_counter(pid_t pid) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, pid, -1, -1, 0);
+}
+
+struct Result {
+    double seconds;
+    long long instructions;  // -1 when perf_event_open is unavailable
+    long peak_rss_kb;
+    int status;
+};
+
+// feed path through a pipe from a separate process
+pid_t feeder(const string &path, int fd[2]) {
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+    close(fd[0]);
+    int in = open(path.c_str(), O_RDONLY);
+    static char buf[1 << 16];
+    ssize_t n;
+    while ((n = read(in, buf, sizeof(buf))) > 0) {
+        for (ssize_t off = 0; off < n;) {
+            ssize_t w = write(fd[1], buf + off, n - off);
+            if (w <= 0) _exit(0);
+            off += w;
+        }
+    }
+    _exit(0);
+}
+
+Result run(const string &filter, const Corpus &corpus, bool piped) {
+    Result res = {0, -1, 0, 0};
+    int sync[2], data[2] = {-1, -1};
+    pipe(sync);
+    if (piped) pipe(data);
+    const double start = now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        // hold exec until the counter is attached
+        close(sync[1]);
+        char c;
+        read(sync[0], &c, 1);
+        if (piped) {
+            dup2(data[0], 0);
+            close(data[0]);
+            close(data[1]);
+        }
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 1);
+        dup2(null, 2);
+        if (piped) {
+            execl(filter.c_str(), filter.c_str(), (char *)nullptr);
+        } else {
+            execl(filter.c_str(), filter.c_str(), corpus.path.c_str(),
+                  (char *)nullptr);
+        }
+        _exit(127);
+    }
+    close(sync[0]);
+    int counter = open_counter(pid);
+    close(sync[1]);
+    pid_t fpid = -1;
+    if (piped) {
+        fpid = feeder(corpus.path, data);
+        close(data[0]);
+        close(data[1]);
+    }
+    struct rusage ru;
+    wait4(pid, &res.status, 0, &ru);
+    res.seconds = now() - start;
+    res.peak_rss_kb = ru.ru_maxrss;
+    if (fpid != -1) waitpid(fpid, nullptr, 0);
+    if (counter != -1) {
+        long long v;
+        if (read(counter, &v, sizeof(v)) == sizeof(v)) res.instructions = v;
+        close(counter);
+    }
+    return res;
+}
+
+int main(int argc, char **argv) {
+    string dir = ".", corpus_dir = "corpus";
+    size_t large_mb = 64, runs = 3;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:m:r:k:")) != -1) {
+        switch (opt) {
+            case 'd':
+                dir = optarg;
+                break;
+            case 'm':
+                large_mb = strtoul(optarg, nullptr, 10);
+                break;
+            case 'r':
+                runs = max(1ul, strtoul(optarg, nullptr, 10));
+                break;
+            case 'k':
+                corpus_dir = optarg;
+                break;
+            default:
+                cerr << "Usage: " << argv[0]
+                     << " [-d filter dir] [-m large corpus MiB] [-r runs]"
+                        " [-k corpus dir]"
+                     << endl;
+                return 1;
+        }
+    }
+    // corpora
+    mkdir(corpus_dir.c_str(), 0777);
+    const size_t small = 64 << 10, large = large_mb << 20;
+    const struct {
+        const char *shape;
+        size_t size;
+    } specs[] = {{"mixed", small},      {"mixed", large},
+                 {"tags", large},       {"text", large},
+                 {"long_lines", large}, {"empty_lines", large},
+                 {"malformed", large}};
+    vector<Corpus> corpora;
+    uint64_t seed = 0x5566;
+    for (const auto &spec : specs) {
+        Corpus c;
+        c.name = string(spec.shape) + (spec.size == small ? "_small" : "_large");
+        c.path = corpus_dir + "/" + c.name + ".txt";
+        c.size = spec.size;
+        struct stat st;
+        // corpora are deterministic, so keep the ones already on disk
+        if (stat(c.path.c_str(), &st) != 0 || size_t(st.st_size) != c.size) {
+            string data = generate(spec.shape, spec.size, seed);
+            FILE *f = fopen(c.path.c_str(), "w");
+            if (f == nullptr || fwrite(data.data(), 1, data.size(), f) !=
+                                    data.size()) {
+                cerr << "cannot write " << c.path << endl;
+                return 1;
+            }
+            fclose(f);
+        }
+        ++seed;
+        corpora.push_back(c);
+    }
+    // runs
+    cout.precision(6);
+    const char *filters[] = {"number", "removetag", "removetag0"};
+    const char *sep = "[\n";
+    for (const char *name : filters) {
+        const string filter = dir + "/" + name;
+        for (const Corpus &corpus : corpora) {
+            for (int piped = 0; piped < 2; ++piped) {
+                // best wall time; instructions and rss from that run
+                Result best = {-1, -1, 0, 0};
+                for (size_t i = 0; i < runs; ++i) {
+                    Result r = run(filter, corpus, piped);
+                    if (best.seconds < 0 || r.seconds < best.seconds)
+                        best = r;
+                }
+                ostringstream os;
+                os << "  {\"filter\":\"" << name << "\",\"corpus\":\""
+                   << corpus.name << "\",\"input\":\""
+                   << (piped ? "pipe" : "file")
+                   << "\",\"bytes\":" << corpus.size
+                   << ",\"seconds\":" << best.seconds << ",\"mb_per_s\":"
+                   << corpus.size / best.seconds / (1 << 20)
+                   << ",\"instructions\":";
+                if (best.instructions < 0) {
+                    os << "null,\"instructions_per_byte\":null";
+                } else {
+                    os << best.instructions << ",\"instructions_per_byte\":"
+                       << double(best.instructions) / corpus.size;
+                }
+                os << ",\"peak_rss_kb\":" << best.peak_rss_kb
+                   << ",\"exit_status\":" << best.status << "}";
+                cout << sep << os.str();
+                sep = ",\n";
+            }
+        }
+    }
+    cout << "\n]" << endl;
+}
@@ -0,0 +1,397 @@
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+using namespace std;
+
+/* synopsis: np_sim [-d server dir] [-C work dir] [-g golden dir] [-w]
+                    [-s settle ms] transcript...
+   Replay each transcript against the servers over their AF_UNIX listener,
+   one line at a time: send it, read the sender's output up to its next
+   prompt, then collect what every other session got until nothing arrives
+   for the settle time. Print a JSON array with one object per server and
+   line: wall time, and the cpu time and syscalls of the server and every
+   command it ran (perf_event_open, null where unavailable). Exit 1 when a
+   server's output differs from <golden dir>/<transcript>.<server>.out (-w
+   writes those instead) or when the servers disagree on a line's output.
+
+   transcript: one "<session> <command line>" per line; '#' lines are
+   comments, except "# servers: <server>..." which picks the servers (all
+   three by default). A server is a binary name, optionally followed by
+   ",VAR=value" settings for its environment. */
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int open_counter(pid_t pid, uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = type;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.inherit = 1;
+    return syscall(__NR_perf_event_open, &attr, pid, -1, -1, 0);
+}
+
+// raw_syscalls:sys_enter, or -1 without tracefs access
+long long syscall_tracepoint() {
+    const char *paths[] = {
+        "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+        "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"};
+    for (const char *path : paths) {
+        ifstream in(path);
+        long long id;
+        if (in >> id) return id;
+    }
+    return -1;
+}
+
+// counts of exited processes are folded into the server's counter, so a
+// command is counted once it has been reaped
+long long read_counter(int fd) {
+    long long v;
+    if (fd == -1 || read(fd, &v, sizeof(v)) != sizeof(v)) return -1;
+    return v;
+}
+
+struct Step {
+    int session;
+    string line;
+};
+
+struct Transcript {
+    string name;
+    vector<string> servers;
+    vector<Step> steps;
+};
+
+bool load(const string &path, Transcript &t) {
+    ifstream in(path);
+    if (!in) return false;
+    t.name = path.substr(path.rfind('/') + 1);
+    t.name = t.name.substr(0, t.name.rfind('.'));
+    t.servers = {"np_simple", "np_single_proc", "np_multi_proc"};
+    string line;
+    while (getline(in, line)) {
+        if (line.compare(0, 10, "# servers:") == 0) {
+            stringstream ss(line.substr(10));
+            t.servers.clear();
+            for (string s; ss >> s;) t.servers.push_back(s);
+        } else if (!line.empty() && line[0] != '#') {
+            stringstream ss(line);
+            Step step;
+            ss >> step.session;
+            ss.get();
+            getline(ss, step.line);
+            t.steps.push_back(step);
+        }
+    }
+    return true;
+}
+
+// unix peer addresses carry the client's pid
+string normalize(const string &out) {
+    string res;
+    size_t i = 0, p;
+    while ((p = out.find("unix/", i)) != string::npos) {
+        size_t q = p + 5;
+        while (q < out.size() && (isdigit(out[q]) || out[q] == '/')) ++q;
+        res += out.substr(i, p - i) + "unix/<peer>";
+        i = q;
+    }
+    return res + out.substr(i);
+}
+
+struct Server {
+    pid_t pid;
+    int clock, syscalls;
+    string sock_path, work;
+    map<int, int> sessions;  // session -> fd
+};
+
+// each server runs in a fresh copy of the work dir, so files one leaves
+// behind do not show up in the next one's output
+bool start(Server &srv, const string &spec, const string &dir,
+           const string &work, long long tracepoint) {
+    stringstream ss(spec);
+    string name, var;
+    getline(ss, name, ',');
+    char exe[PATH_MAX];
+    if (realpath((dir + "/" + name).c_str(), exe) == nullptr) {
+        cerr << "no server " << dir << "/" << name << endl;
+        return false;
+    }
+    srv.sock_path = "/tmp/np_sim." + to_string(getpid()) + ".sock";
+    srv.work = "/tmp/np_sim." + to_string(getpid()) + ".work";
+    const string copy = "rm -rf " + srv.work + " && cp -a " + work + " " +
+                        srv.work;
+    if (system(copy.c_str()) != 0) {
+        cerr << "cannot copy " << work << endl;
+        return false;
+    }
+    int sync[2];
+    pipe(sync);
+    srv.pid = fork();
+    if (srv.pid == 0) {
+        // hold exec until the counters are attached
+        close(sync[1]);
+        char c;
+        read(sync[0], &c, 1);
+        if (chdir(srv.work.c_str()) == -1) _exit(127);
+        setenv("NP_UNIX_PATH", srv.sock_path.c_str(), 1);
+        while (getline(ss, var, ',')) putenv(strdup(var.c_str()));
+        // stdout is the report
+        dup2(2, 1);
+        execl(exe, exe, "0", (char *)nullptr);
+        _exit(127);
+    }
+    close(sync[0]);
+    srv.clock = open_counter(srv.pid, PERF_TYPE_SOFTWARE,
+                             PERF_COUNT_SW_TASK_CLOCK);
+    srv.syscalls = tracepoint < 0 ? -1
+                                  : open_counter(srv.pid, PERF_TYPE_TRACEPOINT,
+                                                 tracepoint);
+    close(sync[1]);
+    return true;
+}
+
+int connect_session(const Server &srv) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, srv.sock_path.c_str(), sizeof(addr.sun_path) - 1);
+    for (int tries = 0; tries < 200; ++tries) {
+        const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            return fd;
+        close(fd);
+        usleep(10000);
+    }
+    return -1;
+}
+
+// read fd until its output ends in a prompt; false at EOF or on timeout
+bool read_prompt(int fd, string &out) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    char buf[65536];
+    while (out.size() < 2 || out.compare(out.size() - 2, 2, "% ") != 0) {
+        if (poll(&pfd, 1, 5000) != 1) return false;
+        const ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0) return false;
+        out.append(buf, n);
+    }
+    return true;
+}
+
+// whatever the sessions receive until settle ms pass without any
+void settle(Server &srv, map<int, string> &got, int settle_ms) {
+    while (!srv.sessions.empty()) {
+        vector<struct pollfd> pfds;
+        for (const pair<const int, int> &s : srv.sessions)
+            pfds.push_back({s.second, POLLIN, 0});
+        if (poll(pfds.data(), pfds.size(), settle_ms) <= 0) return;
+        char buf[65536];
+        for (auto it = srv.sessions.begin(); it != srv.sessions.end();) {
+            struct pollfd pfd = {it->second, POLLIN, 0};
+            if (poll(&pfd, 1, 0) != 1) {
+                ++it;
+                continue;
+            }
+            const ssize_t n = read(it->second, buf, sizeof(buf));
+            if (n > 0) {
+                got[it->first].append(buf, n);
+                ++it;
+            } else {
+                close(it->second);
+                it = srv.sessions.erase(it);
+            }
+        }
+    }
+}
+
+void stop(Server &srv) {
+    for (const pair<const int, int> &s : srv.sessions) close(s.second);
+    srv.sessions.clear();
+    kill(srv.pid, SIGTERM);
+    waitpid(srv.pid, nullptr, 0);
+    if (srv.clock != -1) close(srv.clock);
+    if (srv.syscalls != -1) close(srv.syscalls);
+    unlink(srv.sock_path.c_str());
+    system(("rm -rf " + srv.work).c_str());
+}
+
+string json_str(const string &s) {
+    string res = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            res += '\\';
+            res += c;
+        } else if ((unsigned char)c < 0x20) {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            res += esc;
+        } else {
+            res += c;
+        }
+    }
+    return res + "\"";
+}
+
+int main(int argc, char **argv) {
+    string dir = "../src", work = ".", golden;
+    bool write_golden = false;
+    int settle_ms = 20;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:C:g:ws:")) != -1) {
+        switch (opt) {
+            case 'd':
+                dir = optarg;
+                break;
+            case 'C':
+                work = optarg;
+                break;
+            case 'g':
+                golden = optarg;
+                break;
+            case 'w':
+                write_golden = true;
+                break;
+            case 's':
+                settle_ms = atoi(optarg);
+                break;
+            default:
+                cerr << "Usage: " << argv[0]
+                     << " [-d server dir] [-C work dir] [-g golden dir] [-w]"
+                        " [-s settle ms] transcript..."
+                     << endl;
+                return 1;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    const long long tracepoint = syscall_tracepoint();
+    bool failed = false;
+    const char *sep = "[\n";
+    cout.precision(6);
+    for (int i = optind; i < argc; ++i) {
+        Transcript t;
+        if (!load(argv[i], t)) {
+            cerr << "cannot read " << argv[i] << endl;
+            return 1;
+        }
+        // per step, the sender's output on the first server
+        vector<string> first(t.steps.size());
+        for (size_t k = 0; k < t.servers.size(); ++k) {
+            const string &spec = t.servers[k];
+            Server srv;
+            if (!start(srv, spec, dir, work, tracepoint)) return 1;
+            string log;
+            for (size_t s = 0; s < t.steps.size(); ++s) {
+                const Step &step = t.steps[s];
+                map<int, string> got;
+                if (srv.sessions.count(step.session) == 0) {
+                    // log in, with the banner and others' notices
+                    const int fd = connect_session(srv);
+                    if (fd == -1) {
+                        cerr << spec << ": cannot connect" << endl;
+                        return 1;
+                    }
+                    srv.sessions[step.session] = fd;
+                    read_prompt(fd, got[step.session]);
+                    settle(srv, got, settle_ms);
+                    log += "== login " + to_string(step.session) + "\n";
+                    for (const pair<const int, string> &g : got)
+                        log += "-- " + to_string(g.first) + "\n" + g.second;
+                    got.clear();
+                }
+                const int fd = srv.sessions[step.session];
+                const long long clock0 = read_counter(srv.clock),
+                                sys0 = read_counter(srv.syscalls);
+                const double start = now();
+                const string line = step.line + "\n";
+                write(fd, line.data(), line.size());
+                string &out = got[step.session];
+                if (!read_prompt(fd, out)) {
+                    close(fd);
+                    srv.sessions.erase(step.session);
+                }
+                const double wall = now() - start;
+                settle(srv, got, settle_ms);
+                const long long clock1 = read_counter(srv.clock),
+                                sys1 = read_counter(srv.syscalls);
+                log += "== " + to_string(step.session) + " " + step.line + "\n";
+                for (const pair<const int, string> &g : got)
+                    log += "-- " + to_string(g.first) + "\n" + g.second;
+                // the servers must agree on what the sender sees
+                const string seen = normalize(got[step.session]);
+                if (k == 0) {
+                    first[s] = seen;
+                } else if (seen != first[s]) {
+                    cerr << t.name << ": " << spec << " and " << t.servers[0]
+                         << " differ at line " << s + 1 << " '" << step.line
+                         << "'" << endl;
+                    failed = true;
+                }
+                ostringstream os;
+                os << "  {\"transcript\":" << json_str(t.name)
+                   << ",\"server\":" << json_str(spec) << ",\"step\":" << s + 1
+                   << ",\"session\":" << step.session
+                   << ",\"command\":" << json_str(step.line)
+                   << ",\"wall_ms\":" << wall * 1e3 << ",\"cpu_ms\":";
+                if (clock0 < 0 || clock1 < 0)
+                    os << "null";
+                else
+                    os << (clock1 - clock0) / 1e6;
+                os << ",\"syscalls\":";
+                if (sys0 < 0 || sys1 < 0)
+                    os << "null";
+                else
+                    os << sys1 - sys0;
+                os << "}";
+                cout << sep << os.str();
+                sep = ",\n";
+            }
+            stop(srv);
+            // golden output
+            if (golden.empty()) continue;
+            const string path = golden + "/" + t.name + "." + spec + ".out";
+            log = normalize(log);
+            if (write_golden) {
+                ofstream(path) << log;
+                continue;
+            }
+            ifstream in(path);
+            stringstream expect;
+            expect << in.rdbuf();
+            if (!in || expect.str() != log) {
+                cerr << t.name << ": " << spec << " output differs from "
+                     << path << endl;
+                failed = true;
+            }
+        }
+    }
+    cout << (*sep == '[' ? "[" : "") << "\n]" << endl;
+    return failed ? 1 : 0;
+}
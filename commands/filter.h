@@ -0,0 +1,344 @@
+#ifndef COMMANDS_FILTER_H
+#define COMMANDS_FILTER_H
+// block I/O shared by the commands/ filters
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+const size_t kBlockSize = 1 << 20;
+// unit of work in parallel mode, and the smallest file worth splitting
+const size_t kChunkSize = 8 << 20;
+
+inline void write_all(int fd, const char *p, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            exit(1);
+        }
+        p += w;
+        n -= w;
+    }
+}
+
+// format n right-aligned in width columns into the bytes before end, as
+// printf("%*llu"); returns the first byte
+inline char *format_number(char *end, unsigned long long n, int width) {
+    char *p = end;
+    do {
+        *--p = '0' + n % 10;
+        n /= 10;
+    } while (n != 0);
+    while (end - p < width) *--p = ' ';
+    return p;
+}
+
+// number of c bytes in [p, end)
+inline size_t count_byte(const char *p, const char *end, char c) {
+    size_t n = 0;
+#ifdef __SSE2__
+    const __m128i v = _mm_set1_epi8(c);
+    for (; end - p >= 16; p += 16) {
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        n += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(b, v)));
+    }
+#endif
+    for (; p != end; ++p) n += *p == c;
+    return n;
+}
+
+// buffered writer on a raw fd; large runs bypass the buffer
+class Output {
+   public:
+    explicit Output(int fd)
+        : fd_(fd),
+          len_(0),
+          total_(0),
+          written_(0),
+          stdio_blk_(0),
+          buf_(new char[kBlockSize]) {}
+    ~Output() {
+        flush();
+        delete[] buf_;
+    }
+    // Only write out what a fully buffered stdio stream would have flushed
+    // by now, so text interleaves with unbuffered stderr exactly as it did
+    // with fputc(). Terminals are treated as line buffered.
+    void emulate_stdio() {
+        struct stat st;
+        stdio_blk_ = 8192;  // BUFSIZ
+        if (isatty(fd_)) {
+            stdio_blk_ = -1;
+        } else if (fstat(fd_, &st) == 0 && st.st_blksize > 0 &&
+                   st.st_blksize < stdio_blk_) {
+            stdio_blk_ = st.st_blksize;
+        }
+    }
+    void put(const char *p, size_t n) {
+        if (len_ + n > kBlockSize) {
+            sync();
+            if (stdio_blk_ == 0 && n >= kBlockSize / 2) {
+                write_all(fd_, p, n);
+                total_ += n;
+                written_ += n;
+                return;
+            }
+            while (len_ + n > kBlockSize) {
+                const size_t m = kBlockSize - len_;
+                memcpy(buf_ + len_, p, m);
+                len_ += m, total_ += m;
+                p += m, n -= m;
+                sync();
+            }
+        }
+        memcpy(buf_ + len_, p, n);
+        len_ += n;
+        total_ += n;
+    }
+    void put(const std::string &s) { put(s.data(), s.size()); }
+    void put(char c) {
+        if (len_ == kBlockSize) sync();
+        buf_[len_++] = c;
+        ++total_;
+    }
+    void put_number(unsigned long long n, int width) {
+        char tmp[24], *end = tmp + sizeof(tmp), *p = format_number(end, n, width);
+        put(p, end - p);
+    }
+    // message on stderr, ordered after what stdio would have flushed
+    void report(const std::string &msg) {
+        sync();
+        write_all(2, msg.data(), msg.size());
+    }
+    // write out everything a stdio stream would have; call before writing
+    // to another fd that may share the destination
+    void sync() {
+        size_t n = len_;
+        if (stdio_blk_ > 0) {
+            const size_t blk = stdio_blk_;
+            n = (total_ == 0 ? 0 : (total_ - 1) / blk * blk) - written_;
+        } else if (stdio_blk_ < 0) {
+            const void *nl = memrchr(buf_, '\n', len_);
+            n = nl ? static_cast<const char *>(nl) - buf_ + 1 : 0;
+        }
+        if (n == 0) return;
+        write_all(fd_, buf_, n);
+        memmove(buf_, buf_ + n, len_ - n);
+        len_ -= n;
+        written_ += n;
+    }
+    void flush() {
+        write_all(fd_, buf_, len_);
+        written_ += len_;
+        len_ = 0;
+    }
+
+   private:
+    int fd_;
+    size_t len_;
+    unsigned long long total_, written_;
+    long stdio_blk_;
+    char *buf_;
+};
+
+// output of one chunk processed off the main thread: stdout bytes plus the
+// stderr messages, each tagged with the stdout offset it was written at
+class Chunk {
+   public:
+    void put(const char *p, size_t n) { data_.append(p, n); }
+    void put(const std::string &s) { data_ += s; }
+    void put(char c) { data_ += c; }
+    void put_number(unsigned long long n, int width) {
+        char tmp[24], *end = tmp + sizeof(tmp), *p = format_number(end, n, width);
+        data_.append(p, end);
+    }
+    void report(const std::string &msg) {
+        reports_.push_back(std::make_pair(data_.size(), msg));
+    }
+    // replay into out in order and reset
+    void drain(Output &out) {
+        size_t off = 0;
+        for (const std::pair<size_t, std::string> &r : reports_) {
+            out.put(data_.data() + off, r.first - off);
+            out.report(r.second);
+            off = r.first;
+        }
+        out.put(data_.data() + off, data_.size() - off);
+        data_.clear();
+        reports_.clear();
+    }
+
+   private:
+    std::string data_;
+    std::vector<std::pair<size_t, std::string>> reports_;
+};
+
+// fixed set of worker threads; the calling thread joins in on run()
+class ThreadPool {
+   public:
+    explicit ThreadPool(size_t threads)
+        : fn_(nullptr), n_(0), next_(0), active_(0), gen_(0), stop_(false) {
+        for (size_t i = 1; i < threads; ++i)
+            workers_.emplace_back(&ThreadPool::loop, this);
+    }
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (std::thread &t : workers_) t.join();
+    }
+    // fn(i) for every i in [0, n); returns when all calls are done
+    void run(size_t n, const std::function<void(size_t)> &fn) {
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            fn_ = &fn;
+            n_ = n;
+            next_ = 0;
+            active_ = workers_.size();
+            ++gen_;
+        }
+        cv_.notify_all();
+        work();
+        std::unique_lock<std::mutex> lock(mu_);
+        done_.wait(lock, [this] { return active_ == 0; });
+    }
+
+   private:
+    void work() {
+        size_t i;
+        while ((i = next_++) < n_) (*fn_)(i);
+    }
+    void loop() {
+        unsigned long gen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mu_);
+                cv_.wait(lock, [&] { return stop_ || gen_ != gen; });
+                if (stop_) return;
+                gen = gen_;
+            }
+            work();
+            std::lock_guard<std::mutex> lock(mu_);
+            if (--active_ == 0) done_.notify_one();
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    std::mutex mu_;
+    std::condition_variable cv_, done_;
+    const std::function<void(size_t)> *fn_;
+    size_t n_;
+    std::atomic<size_t> next_;
+    size_t active_;
+    unsigned long gen_;
+    bool stop_;
+};
+
+// threads for chunked mode: FILTER_THREADS, else every online CPU
+inline size_t filter_threads() {
+    const char *env = getenv("FILTER_THREADS");
+    long n = env ? atol(env) : std::thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+}
+
+// input from a file argument (mmapped when regular) or stdin (read in
+// kBlockSize blocks). The original filters read with `char c = fgetc()`, so a
+// 0xff byte compares equal to EOF and ends the input; next() keeps that.
+class Input {
+   public:
+    Input()
+        : fd_(0),
+          map_(nullptr),
+          map_size_(0),
+          size_(0),
+          eof_(false),
+          buf_(nullptr) {}
+    ~Input() {
+        if (map_ != nullptr) munmap(map_, map_size_);
+        if (fd_ > 0) close(fd_);
+        delete[] buf_;
+    }
+    // synopsis: cmd [file]; false on any other argument count
+    bool open(int argc, char **argv) {
+        if (argc == 2) {
+            fd_ = ::open(argv[1], O_RDONLY);
+            if (fd_ == -1) {
+                fprintf(stderr, "%s: %s: %s\n", argv[0], argv[1],
+                        strerror(errno));
+                exit(1);
+            }
+            struct stat st;
+            if (fstat(fd_, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+                map_size_ = st.st_size;
+                void *p =
+                    mmap(nullptr, map_size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+                if (p != MAP_FAILED) {
+                    map_ = static_cast<char *>(p);
+                    madvise(map_, map_size_, MADV_SEQUENTIAL);
+                    const void *ff = memchr(map_, 0xff, map_size_);
+                    size_ = ff ? static_cast<const char *>(ff) - map_
+                               : map_size_;
+                }
+            }
+        } else if (argc != 1) {
+            return false;
+        }
+        if (map_ == nullptr) buf_ = new char[kBlockSize];
+        return true;
+    }
+    // whole input when mmapped, nullptr otherwise
+    const char *data() const { return map_; }
+    size_t size() const { return size_; }
+    // next block of input; false at EOF
+    bool next(const char *&p, size_t &n) {
+        if (eof_) return false;
+        if (map_ != nullptr) {
+            eof_ = true;
+            p = map_;
+            n = size_;
+            return n != 0;
+        }
+        ssize_t r;
+        while ((r = read(fd_, buf_, kBlockSize)) == -1 && errno == EINTR)
+            ;
+        if (r <= 0) {
+            eof_ = true;
+            return false;
+        }
+        const void *ff = memchr(buf_, 0xff, r);
+        if (ff != nullptr) {
+            eof_ = true;
+            r = static_cast<const char *>(ff) - buf_;
+        }
+        p = buf_;
+        n = r;
+        return n != 0;
+    }
+
+   private:
+    int fd_;
+    char *map_;
+    size_t map_size_, size_;
+    bool eof_;
+    char *buf_;
+};
+
+#endif
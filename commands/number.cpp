@@ -1,47 +1,107 @@
-#include <stdio.h>
-#include <iostream>
-#include <string>
-#include <stdlib.h>
-#include <cstring>
-
-FILE *fd;
-using namespace std;
-
-int main(int argc, char *argv[])
-{
-  char c;
-  int counter = 1;
-
-  if(argc == 1)
-     fd = stdin;
-  else if(argc == 2)
-     fd = fopen(argv[1], "r");
-  else
-  {
-     fprintf(stderr,"Usage");
-     exit(1);
-  }
-  
-  string str="";
-  while((c = fgetc(fd))!=EOF)
-  {
-    if (c == -1)
-      break;
-    str+=c;
-    if (c == '\n'){
-      fprintf(stdout, "%4d %s", counter++, str.c_str());
-      str="";
-    }
-  } 
-  if( strcmp( str.c_str(), "") !=0 )
-  {
-      cout << "   " << counter++ << " " << str;
-      cout << endl;
-  }
-  fclose(fd);
-  return 0;
-
-}
-
-
- 
+#include <cstring>
+#include <string>
+#include <vector>
+#include "filter.h"
+
+using namespace std;
+
+// prefix every line with its number: "%4d " for terminated lines and
+// "   N " plus a newline for a trailing unterminated one. Terminated lines
+// used to go through printf("%s"), so they end at an embedded NUL (newline
+// included).
+template <class Out>
+class Numberer {
+   public:
+    Numberer(Out &out, unsigned long long first)
+        : out_(out), counter_(first) {}
+    void feed(const char *p, size_t n) {
+        const char *end = p + n, *nl;
+        const bool has_nul = memchr(p, '\0', n) != nullptr;
+        while ((nl = static_cast<const char *>(memchr(p, '\n', end - p)))) {
+            out_.put_number(counter_++, 4);
+            out_.put(' ');
+            const char *line_end = nl + 1;
+            if (!tail_.empty()) {
+                const size_t nul = tail_.find('\0');
+                out_.put(tail_.data(), min(nul, tail_.size()));
+                tail_.clear();
+                if (nul != string::npos) line_end = p;
+            }
+            if (has_nul && line_end != p) {
+                const void *nul = memchr(p, '\0', line_end - p);
+                if (nul != nullptr) line_end = static_cast<const char *>(nul);
+            }
+            out_.put(p, line_end - p);
+            p = nl + 1;
+        }
+        tail_.append(p, end - p);
+    }
+    void finish() {
+        if (tail_.empty()) return;
+        out_.put("   ", 3);
+        out_.put_number(counter_++, 0);
+        out_.put(' ');
+        out_.put(tail_);
+        out_.put('\n');
+        tail_.clear();
+    }
+
+   private:
+    Out &out_;
+    unsigned long long counter_;
+    string tail_;
+};
+
+// Cut a window of chunks at line boundaries, count their lines in
+// parallel, prefix-sum the counts into starting numbers, then number the
+// chunks in parallel and write them out in order.
+void number_parallel(const char *p, const char *end, size_t threads,
+                     Output &out) {
+    ThreadPool pool(threads);
+    const size_t window = threads * 2;
+    vector<const char *> bounds;
+    vector<unsigned long long> first(window + 1);
+    vector<Chunk> chunks(window);
+    first[0] = 1;
+    while (p != end) {
+        bounds.assign(1, p);
+        while (bounds.size() <= window && p != end) {
+            const char *q = p + min(kChunkSize, size_t(end - p));
+            const void *nl = memchr(q, '\n', end - q);
+            p = nl ? static_cast<const char *>(nl) + 1 : end;
+            bounds.push_back(p);
+        }
+        const size_t n = bounds.size() - 1;
+        pool.run(n, [&](size_t i) {
+            first[i + 1] = count_byte(bounds[i], bounds[i + 1], '\n');
+        });
+        for (size_t i = 1; i <= n; ++i) first[i] += first[i - 1];
+        pool.run(n, [&](size_t i) {
+            Numberer<Chunk> numberer(chunks[i], first[i]);
+            numberer.feed(bounds[i], bounds[i + 1] - bounds[i]);
+            numberer.finish();
+        });
+        for (size_t i = 0; i < n; ++i) chunks[i].drain(out);
+        first[0] = first[n];
+    }
+}
+
+int main(int argc, char *argv[]) {
+    Input in;
+    if (!in.open(argc, argv)) {
+        fprintf(stderr, "Usage");
+        exit(1);
+    }
+    Output out(1);
+    const size_t threads = filter_threads();
+    if (in.data() != nullptr && in.size() >= 2 * kChunkSize && threads > 1) {
+        number_parallel(in.data(), in.data() + in.size(), threads, out);
+        return 0;
+    }
+    Numberer<Output> numberer(out, 1);
+    const char *p;
+    size_t n;
+    while (in.next(p, n)) numberer.feed(p, n);
+    numberer.finish();
+    return 0;
+}
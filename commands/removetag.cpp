@@ -1,34 +1,20 @@
-#include <stdio.h>
-#include <stdlib.h>
-
-int main(int argc,char **argv){
-         FILE *fp;
-         char c;
-         int inTag=0;
-
-         if(argc == 1)
-                fp = stdin;
-         else if (argc == 2)
-                fp = fopen(argv[1],"r");
-         else{ 
-         	fprintf(stderr,"Usage:%s <file>\n",argv[1]);
-                exit(1);
-         }
-         while((c = fgetc(fp))!=EOF){
-                 if(c == '<'){
-                         inTag = 1;
-                         continue;
-                 }
-                 if(c == '>'){
-                         inTag = 0;
-                         continue;
-
-                 }
-                 if(!inTag)
-                         fputc(c, stdout);
-         }  
-//		 fputc('\n' , stdout) ;
-		 fflush(stdout);
-         fclose(fp);
-         return(0);
-}          
+#include "tagstrip.h"
+
+int main(int argc, char **argv) {
+    Input in;
+    if (!in.open(argc, argv)) {
+        fprintf(stderr, "Usage:%s <file>\n", argv[1]);
+        exit(1);
+    }
+    Output out(1);
+    const size_t threads = filter_threads();
+    if (in.data() != nullptr && in.size() >= 2 * kChunkSize && threads > 1) {
+        strip_parallel(in.data(), in.data() + in.size(), false, threads, out);
+        return 0;
+    }
+    TagStripper<Output> stripper(out, false);
+    const char *p;
+    size_t n;
+    while (in.next(p, n)) stripper.feed(p, n);
+    return 0;
+}
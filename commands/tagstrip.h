@@ -0,0 +1,192 @@
+#ifndef COMMANDS_TAGSTRIP_H
+#define COMMANDS_TAGSTRIP_H
+// tag stripping shared by removetag and removetag0
+#include <cstring>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+#include "filter.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// first '<' or '>' in [p, end), or end
+inline const char *find_angle(const char *p, const char *end) {
+#ifdef __SSE2__
+    const __m128i lt = _mm_set1_epi8('<'), gt = _mm_set1_epi8('>');
+    for (; end - p >= 16; p += 16) {
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        const int m = _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(b, lt), _mm_cmpeq_epi8(b, gt)));
+        if (m != 0) return p + __builtin_ctz(m);
+    }
+#endif
+    for (; p != end; ++p)
+        if (*p == '<' || *p == '>') return p;
+    return end;
+}
+
+inline bool is_tag_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '/';
+}
+
+// whether [p, end) holds only isalpha() (C locale) and '/'
+inline bool all_tag_chars(const char *p, const char *end) {
+#ifdef __SSE2__
+    // (b | 0x20) - 'a' < 26 selects letters; shifted by 0x80 to compare signed
+    const __m128i lower = _mm_set1_epi8(0x20),
+                  bias = _mm_set1_epi8(static_cast<char>(0x80 - 'a')),
+                  limit = _mm_set1_epi8(static_cast<char>(0x80 + 26)),
+                  slash = _mm_set1_epi8('/');
+    for (; end - p >= 16; p += 16) {
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        const __m128i x = _mm_add_epi8(_mm_or_si128(b, lower), bias);
+        const __m128i ok = _mm_or_si128(_mm_cmplt_epi8(x, limit),
+                                        _mm_cmpeq_epi8(b, slash));
+        if (_mm_movemask_epi8(ok) != 0xffff) return false;
+    }
+#endif
+    for (; p != end; ++p)
+        if (!is_tag_char(*p)) return false;
+    return true;
+}
+
+// last '<' or '>' in [p, end), or nullptr
+inline const char *rfind_angle(const char *p, const char *end) {
+#ifdef __SSE2__
+    const __m128i lt = _mm_set1_epi8('<'), gt = _mm_set1_epi8('>');
+    for (; end - p >= 16; end -= 16) {
+        const __m128i b =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(end - 16));
+        const int m = _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(b, lt), _mm_cmpeq_epi8(b, gt)));
+        if (m != 0) return end - 16 + (31 - __builtin_clz(m));
+    }
+#endif
+    while (end != p) {
+        --end;
+        if (*end == '<' || *end == '>') return end;
+    }
+    return nullptr;
+}
+
+inline std::string illegal_tag(const std::string &tag) {
+    // printed with %s before, so stop at an embedded NUL
+    return "Error: illegal tag \"" + std::string(tag.c_str()) + "\"\n";
+}
+
+/* Drop everything between '<' and '>' (and both brackets themselves).
+   With check set, report tags holding anything but letters and '/' on
+   stderr when the next text byte is reached; the reported text is every tag
+   byte seen since the previous text byte.
+   A stripper started mid-input (defer_lead) does not know the tag bytes
+   before it, so it keeps the ones ahead of its first text byte in lead_tag()
+   instead of reporting them; the caller reports at offset 0 of its output. */
+template <class Out>
+class TagStripper {
+   public:
+    TagStripper(Out &out, bool check, bool in_tag = false,
+                bool defer_lead = false)
+        : out_(out),
+          check_(check),
+          in_tag_(in_tag),
+          err_tag_(false),
+          defer_lead_(defer_lead),
+          lead_err_(false) {}
+    void feed(const char *p, size_t n) {
+        const char *end = p + n;
+        while (p != end) {
+            const char *q = find_angle(p, end);
+            if (in_tag_) {
+                if (check_) {
+                    tag_.append(p, q);
+                    if (!err_tag_) err_tag_ = !all_tag_chars(p, q);
+                }
+            } else if (p != q) {
+                if (defer_lead_) {
+                    defer_lead_ = false;
+                    lead_tag_.swap(tag_);
+                    lead_err_ = err_tag_;
+                    err_tag_ = false;
+                } else if (err_tag_) {
+                    out_.report(illegal_tag(tag_));
+                    err_tag_ = false;
+                }
+                tag_.clear();
+                out_.put(p, q - p);
+            }
+            if (q == end) break;
+            if (*q == '<') in_tag_ = true;
+            if (*q == '>') in_tag_ = false;
+            p = q + 1;
+        }
+    }
+    // text seen since construction (only tracked with defer_lead)
+    bool seen_text() const { return !defer_lead_; }
+    const std::string &lead_tag() const { return lead_tag_; }
+    bool lead_err() const { return lead_err_; }
+    // tag bytes since the last text byte
+    const std::string &tag() const { return tag_; }
+    bool err_tag() const { return err_tag_; }
+
+   private:
+    Out &out_;
+    const bool check_;
+    bool in_tag_, err_tag_, defer_lead_, lead_err_;
+    std::string tag_, lead_tag_;
+};
+
+/* Split the input into fixed chunks. The tag state entering a chunk only
+   depends on the last bracket before it, so that is found in parallel
+   first; the chunks are then stripped in parallel and stitched in order,
+   carrying pending tag text and its error flag across chunks that have no
+   text of their own. */
+inline void strip_parallel(const char *p, const char *end, bool check,
+                           size_t threads, Output &out) {
+    ThreadPool pool(threads);
+    const size_t window = threads * 2;
+    std::vector<const char *> bounds;
+    std::vector<char> last(window);
+    std::vector<bool> in_tag(window + 1);
+    std::vector<Chunk> chunks(window);
+    std::vector<std::unique_ptr<TagStripper<Chunk>>> strippers(window);
+    std::string carry_tag;
+    bool carry_err = false;
+    in_tag[0] = false;
+    while (p != end) {
+        bounds.assign(1, p);
+        while (bounds.size() <= window && p != end) {
+            p += std::min(kChunkSize, size_t(end - p));
+            bounds.push_back(p);
+        }
+        const size_t n = bounds.size() - 1;
+        pool.run(n, [&](size_t i) {
+            const char *q = rfind_angle(bounds[i], bounds[i + 1]);
+            last[i] = q ? *q : 0;
+        });
+        for (size_t i = 0; i < n; ++i)
+            in_tag[i + 1] = last[i] ? last[i] == '<' : in_tag[i];
+        pool.run(n, [&](size_t i) {
+            strippers[i].reset(
+                new TagStripper<Chunk>(chunks[i], check, in_tag[i], true));
+            strippers[i]->feed(bounds[i], bounds[i + 1] - bounds[i]);
+        });
+        for (size_t i = 0; i < n; ++i) {
+            const TagStripper<Chunk> &s = *strippers[i];
+            if (!s.seen_text()) {
+                carry_tag += s.tag();
+                carry_err = carry_err || s.err_tag();
+            } else {
+                if (carry_err || s.lead_err())
+                    out.report(illegal_tag(carry_tag + s.lead_tag()));
+                chunks[i].drain(out);
+                carry_tag = s.tag();
+                carry_err = s.err_tag();
+            }
+        }
+        in_tag[0] = in_tag[n];
+    }
+}
+
+#endif
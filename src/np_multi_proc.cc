@@ -1,26 +1,207 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <sys/ipc.h>
 #include <sys/sem.h>
 #include <sys/shm.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
 #include <csignal>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <deque>
+#include <fstream>
 #include <iostream>
+#include <list>
 #include <sstream>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #define IS_PIPE(x) ((x) > 2)
 using namespace std;
 
+/* tracing
+   Spans of the command being run go into a fixed ring. A slot's seq is 0
+   while it is written and its index + 1 after, so the SIGUSR2 dump (which
+   may interrupt a write) skips torn slots without locking. Commands slower
+   than NP_TRACE_SLOW_MS are logged with their breakdown. */
+enum { TR_CMD, TR_PARSE, TR_PIPE_WAIT, TR_FORK, TR_WAIT, TR_WRITE, TR_KINDS };
+const char *const tr_names[TR_KINDS] = {"command", "parse", "pipe_wait",
+                                        "fork",    "wait",  "write"};
+struct tr_span {
+    volatile uint64_t seq;
+    uint64_t start, dur;
+    int uid, kind, stage;
+    char text[48];
+};
+const uint64_t kTrRing = 4096;
+tr_span tr_ring[kTrRing];
+uint64_t tr_head = 0;
+// current command
+bool tr_active = false;
+int tr_uid = -1;
+string tr_cmd;
+uint64_t tr_start, tr_total[TR_KINDS];
+// NP_TRACE_SLOW_MS (0 disables the log) and where it goes
+uint64_t tr_slow_ns = 0;
+int tr_log_fd = 2;
+
+uint64_t tr_now() {
+    // vDSO, no syscall
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void tr_record(int kind, uint64_t start, int stage = -1,
+               const char *text = nullptr) {
+    if (!tr_active) return;
+    const uint64_t end = tr_now();
+    tr_total[kind] += end - start;
+    tr_span &s = tr_ring[tr_head % kTrRing];
+    s.seq = 0;
+    atomic_signal_fence(memory_order_seq_cst);
+    s.start = start;
+    s.dur = end - start;
+    s.uid = tr_uid;
+    s.kind = kind;
+    s.stage = stage;
+    strncpy(s.text, text ? text : "", sizeof(s.text) - 1);
+    s.text[sizeof(s.text) - 1] = '\0';
+    atomic_signal_fence(memory_order_seq_cst);
+    s.seq = ++tr_head;
+}
+
+void tr_begin(int uid, const string &cmd) {
+    tr_active = true;
+    tr_uid = uid;
+    tr_cmd = cmd;
+    tr_start = tr_now();
+    for (uint64_t &t : tr_total) t = 0;
+}
+
+void tr_end() {
+    if (!tr_active) return;
+    tr_record(TR_CMD, tr_start, -1, tr_cmd.c_str());
+    tr_active = false;
+    const uint64_t dur = tr_total[TR_CMD];
+    if (tr_slow_ns == 0 || dur < tr_slow_ns) return;
+    ostringstream os;
+    os.setf(ios::fixed);
+    os.precision(3);
+    os << "slow command: uid " << tr_uid << " pid " << getpid() << " "
+       << dur / 1e6 << " ms '" << tr_cmd << "':";
+    for (int k = TR_PARSE; k < TR_KINDS; ++k)
+        os << ' ' << tr_names[k] << '=' << tr_total[k] / 1e6;
+    os << '\n';
+    const string msg = os.str();
+    write(tr_log_fd, msg.c_str(), msg.size());
+}
+
+// async-signal-safe text buffer for the dump
+struct tr_out {
+    int fd;
+    size_t len;
+    char buf[4096];
+    void flush() {
+        write(fd, buf, len);
+        len = 0;
+    }
+    void put(const char *s) {
+        for (; *s; ++s) put(*s);
+    }
+    void put(char c) {
+        if (len == sizeof(buf)) flush();
+        buf[len++] = c;
+    }
+    void put(uint64_t n) {
+        char tmp[24], *p = tmp + sizeof(tmp);
+        *--p = '\0';
+        do *--p = '0' + n % 10;
+        while ((n /= 10) != 0);
+        put(p);
+    }
+    // nanoseconds as fractional microseconds
+    void put_us(uint64_t ns) {
+        put(ns / 1000);
+        put('.');
+        put(char('0' + ns / 100 % 10));
+        put(char('0' + ns / 10 % 10));
+        put(char('0' + ns % 10));
+    }
+    void put_json(const char *s) {
+        for (; *s; ++s) {
+            if (*s == '"' || *s == '\\') put('\\');
+            put((unsigned char)*s < 0x20 ? '?' : *s);
+        }
+    }
+};
+
+// SIGUSR2: write the ring as a Chrome/Perfetto trace to np_trace.<pid>.json
+void tr_dump(int sig) {
+    const int saved_errno = errno;
+    static tr_out out;
+    char path[40] = "np_trace.", *p = path + 9, digits[16];
+    int n = 0;
+    for (pid_t pid = getpid(); pid != 0; pid /= 10) digits[n++] = '0' + pid % 10;
+    while (n > 0) *p++ = digits[--n];
+    strcpy(p, ".json");
+    out.len = 0;
+    out.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out.fd == -1) {
+        errno = saved_errno;
+        return;
+    }
+    out.put("{\"traceEvents\":[");
+    const uint64_t head = tr_head;
+    const char *sep = "\n";
+    for (uint64_t i = head > kTrRing ? head - kTrRing : 0; i < head; ++i) {
+        const tr_span &slot = tr_ring[i % kTrRing];
+        if (slot.seq != i + 1) continue;
+        tr_span s;
+        memcpy(&s, (const void *)&slot, sizeof(s));
+        atomic_signal_fence(memory_order_seq_cst);
+        if (slot.seq != i + 1) continue;
+        out.put(sep);
+        sep = ",\n";
+        out.put("{\"name\":\"");
+        out.put(tr_names[s.kind]);
+        out.put("\",\"ph\":\"X\",\"ts\":");
+        out.put_us(s.start);
+        out.put(",\"dur\":");
+        out.put_us(s.dur);
+        out.put(",\"pid\":");
+        out.put(uint64_t(getpid()));
+        out.put(",\"tid\":");
+        out.put(uint64_t(s.uid + 1));
+        out.put(",\"args\":{");
+        if (s.stage >= 0) {
+            out.put("\"stage\":");
+            out.put(uint64_t(s.stage));
+            out.put(',');
+        }
+        out.put("\"text\":\"");
+        out.put_json(s.text);
+        out.put("\"}}");
+    }
+    out.put("\n]}\n");
+    out.flush();
+    close(out.fd);
+    errno = saved_errno;
+}
+
 int my_uid = -1;
 string my_address, my_name;
 bool is_signaled = false;
@@ -40,6 +221,7 @@ void sem_signal(int key, short unsigned int sem = 0) {
 }
 
 void broadcast(string msg) {
+    const uint64_t t = tr_now();
     sem_wait(sem_pid);
     int *np_user = (int *)shmat(shm_pid, nullptr, 0);
     for (size_t i = 0; i < 30; ++i) {
@@ -56,6 +238,7 @@ void broadcast(string msg) {
     flush(cout);
     sem_wait(sem_msg, my_uid);
     sem_signal(sem_msg, my_uid);
+    tr_record(TR_WRITE, t);
 }
 
 void convert(const vector<string> &from, vector<char *> &to) {
@@ -66,7 +249,120 @@ void convert(const vector<string> &from, vector<char *> &to) {
     to.push_back(nullptr);
 }
 
+/* per-session cgroups (cgroup v2)
+   NP_CGROUP_ROOT names a cgroup directory delegated to the server (not the
+   one it runs in). Each session gets a group np-<server pid>-<uid> there
+   that its commands join between fork and exec, limited by
+   NP_CGROUP_CPU_WEIGHT, NP_CGROUP_MEMORY_MAX and NP_CGROUP_PIDS_MAX. The
+   group's cpu and memory usage is logged when the user leaves. Anything
+   the kernel refuses (no delegation, controller missing) just leaves the
+   commands where the session is. */
+string np_cg_root;
+pid_t np_server_pid;
+struct cg_limit {
+    const char *file, *env;
+    const char *value;
+} np_cg_limits[] = {{"cpu.weight", "NP_CGROUP_CPU_WEIGHT", nullptr},
+                    {"memory.max", "NP_CGROUP_MEMORY_MAX", nullptr},
+                    {"pids.max", "NP_CGROUP_PIDS_MAX", nullptr}};
+// the session's cgroup.procs, or -1
+int np_cg_procs = -1;
+
+bool cg_write(const string &path, const string &value) {
+    const int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+    const bool ok =
+        write(fd, value.data(), value.size()) == ssize_t(value.size());
+    close(fd);
+    return ok;
+}
+
+// in the server, once
+void cg_init() {
+    np_server_pid = getpid();
+    const char *root = getenv("NP_CGROUP_ROOT");
+    if (root == nullptr || *root == '\0') return;
+    np_cg_root = root;
+    for (cg_limit &limit : np_cg_limits) limit.value = getenv(limit.env);
+    // one at a time: a controller the root lacks must not block the others
+    for (const char *ctl : {"+cpu", "+memory", "+pids"})
+        cg_write(np_cg_root + "/cgroup.subtree_control", ctl);
+}
+
+string cg_path() {
+    return np_cg_root + "/np-" + to_string(np_server_pid) + "-" +
+           to_string(my_uid);
+}
+
+void cg_open() {
+    if (np_cg_root.empty()) return;
+    // a group left busy by a previous session in the slot is reused
+    const string dir = cg_path();
+    if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST) return;
+    for (const cg_limit &limit : np_cg_limits) {
+        if (limit.value != nullptr)
+            cg_write(dir + "/" + limit.file, limit.value);
+    }
+    np_cg_procs = open((dir + "/cgroup.procs").c_str(), O_WRONLY | O_CLOEXEC);
+}
+
+// first number after key in a cgroup file ("" for a single value), or -1
+long long cg_read(const string &path, const string &key) {
+    ifstream in(path);
+    string word;
+    long long value;
+    if (key.empty()) return in >> value ? value : -1;
+    while (in >> word)
+        if (word == key) return in >> value ? value : -1;
+    return -1;
+}
+
+void cg_close() {
+    if (np_cg_procs == -1) return;
+    close(np_cg_procs);
+    np_cg_procs = -1;
+    const string dir = cg_path();
+    ostringstream os;
+    os << "session usage: uid " << my_uid << " cpu "
+       << cg_read(dir + "/cpu.stat", "usage_usec") / 1000 << " ms";
+    const long long peak = cg_read(dir + "/memory.peak", "");
+    if (peak != -1) os << " memory peak " << peak / 1024 << " KiB";
+    os << '\n';
+    const string msg = os.str();
+    write(tr_log_fd, msg.c_str(), msg.size());
+    // busy while commands left in the background still run
+    rmdir(dir.c_str());
+}
+
+// in a forked command: join the session's group
+void cg_enter() {
+    if (np_cg_procs != -1) write(np_cg_procs, "0", 1);
+}
+
+/* teardown
+   A session leads its own process group, which the commands it starts
+   (and whatever they start) inherit. On logout the session steps back
+   into the server's group and ends what is left: SIGTERM, then SIGKILL
+   once its own commands are reaped or NP_KILL_GRACE ms (default 500)
+   pass. The group id is the session's pid, so it cannot have been reused
+   while the session signals it. */
+pid_t np_server_pgid;
+double np_kill_grace = 500;
+
+void end_commands() {
+    setpgid(0, np_server_pgid);
+    const pid_t group = getpid();
+    if (killpg(group, SIGTERM) == -1) return;
+    const uint64_t deadline = tr_now() + uint64_t(np_kill_grace * 1e6);
+    while (waitpid(-1, nullptr, WNOHANG) != -1 && tr_now() < deadline)
+        usleep(10000);
+    killpg(group, SIGKILL);
+    while (waitpid(-1, nullptr, 0) != -1 || errno == EINTR)
+        ;
+}
+
 void mywait(deque<int> &pid) {
+    const uint64_t t = tr_now();
     int p;
     bool has_wait = false;
     // clean up finished process
@@ -74,12 +370,12 @@ void mywait(deque<int> &pid) {
         pid.erase(std::remove(pid.begin(), pid.end(), p), pid.end());
         has_wait = true;
     }
-    if (has_wait) return;
     // wait for the front of deque
-    if (!pid.empty()) {
+    if (!has_wait && !pid.empty()) {
         waitpid(pid.front(), nullptr, 0);
         pid.pop_front();
     }
+    tr_record(TR_PIPE_WAIT, t);
 }
 
 void exec(const vector<vector<string>> &args, deque<int> &pidout, int fdin,
@@ -93,8 +389,11 @@ void exec(const vector<vector<string>> &args, deque<int> &pidout, int fdin,
         if (i != len - 1) {
             while (pipe(fd[cur]) == -1) mywait(pidout);
         }
+        const uint64_t t = tr_now();
         while ((pid[cur] = fork()) == -1) mywait(pidout);
         if (pid[cur] == 0) {
+            signal(SIGPIPE, SIG_DFL);
+            cg_enter();
             // fd[0] -> stdin
             if (i != 0) {
                 close(fd[1 - cur][1]);
@@ -116,6 +415,7 @@ void exec(const vector<vector<string>> &args, deque<int> &pidout, int fdin,
             cerr << "Unknown command: [" << arg[0] << "]." << endl;
             exit(0);
         }
+        tr_record(TR_FORK, t, i, args[i][0].c_str());
         pidout.push_back(pid[cur]);
         if (i != 0) {
             close(fd[1 - cur][0]);
@@ -124,6 +424,430 @@ void exec(const vector<vector<string>> &args, deque<int> &pidout, int fdin,
     }
 }
 
+// whether another command line may already be waiting, in stdin's buffer
+// or on the socket
+bool input_pending() {
+    if (stdin->_IO_read_ptr != stdin->_IO_read_end) return true;
+    struct pollfd pfd = {0, POLLIN, 0};
+    return poll(&pfd, 1, 0) == 1;
+}
+
+/* dead peers and idle sessions
+   NP_KEEPALIVE (seconds) turns on TCP keepalive, NP_USER_TIMEOUT (ms) caps
+   how long sent data may stay unacknowledged, and NP_IDLE_TIMEOUT
+   (seconds) ends a session that waits that long for a command line. The
+   idle wait polls stdin instead of setting SO_RCVTIMEO, which the
+   commands reading the socket would inherit. */
+int np_keepalive = 0, np_user_timeout = 0;
+double np_idle_timeout = 0;
+
+// false when no command line starts within NP_IDLE_TIMEOUT; messages
+// (SIGUSR1) do not count as activity
+bool wait_input() {
+    if (np_idle_timeout <= 0 || stdin->_IO_read_ptr != stdin->_IO_read_end)
+        return true;
+    const uint64_t deadline = tr_now() + uint64_t(np_idle_timeout * 1e9);
+    struct pollfd pfd = {0, POLLIN, 0};
+    while (true) {
+        const uint64_t now = tr_now();
+        if (now >= deadline) return false;
+        const int ret = poll(&pfd, 1, (deadline - now) / 1000000 + 1);
+        if (ret != -1 || errno != EINTR) return ret != 0;
+    }
+}
+
+void tune_socket(int csock) {
+    if (np_keepalive > 0) {
+        const int on = 1, cnt = 3, intvl = max(1, np_keepalive / 3);
+        setsockopt(csock, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+        setsockopt(csock, IPPROTO_TCP, TCP_KEEPIDLE, &np_keepalive,
+                   sizeof(np_keepalive));
+        setsockopt(csock, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl));
+        setsockopt(csock, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt));
+    }
+    if (np_user_timeout > 0) {
+        setsockopt(csock, IPPROTO_TCP, TCP_USER_TIMEOUT, &np_user_timeout,
+                   sizeof(np_user_timeout));
+    }
+}
+
+/* connection storms
+   NP_BACKLOG sets the listen() backlog (default 128), and each wakeup
+   drains the whole accept queue. NP_ACCEPT_RATE (connections per second,
+   default 0: no limit) and NP_ACCEPT_BURST (default 10) give each source
+   IP a token bucket; a connection finding it empty is reset at once,
+   before anything else is spent on it. NP_DEFER_ACCEPT (seconds) sets
+   TCP_DEFER_ACCEPT, which holds a connection back until the client sends
+   something. Clients here wait for the welcome first, so they would only
+   get it after that timeout; it is off by default. While connections are
+   being turned away, the counts of accepted, shed and over capacity
+   (server full) connections go to stderr at most once a second. */
+int np_backlog = 128, np_defer_accept = 0;
+double np_accept_rate = 0, np_accept_burst = 10;
+struct bucket {
+    double tokens;
+    uint64_t last;
+};
+const size_t kBucketsMax = 4096;
+unordered_map<uint32_t, bucket> np_buckets;
+uint64_t np_accepted = 0, np_shed = 0, np_over = 0, np_reported = 0;
+
+// whether ip (network order) may connect now; takes one of its tokens
+bool take_token(uint32_t ip) {
+    if (np_accept_rate <= 0) return true;
+    const uint64_t now = tr_now();
+    const double per_ns = np_accept_rate * 1e-9;
+    if (np_buckets.size() >= kBucketsMax) {
+        // forget full buckets, or everyone if that is not enough
+        for (auto it = np_buckets.begin(); it != np_buckets.end();) {
+            const bucket &b = it->second;
+            if (b.tokens + (now - b.last) * per_ns >= np_accept_burst)
+                it = np_buckets.erase(it);
+            else
+                ++it;
+        }
+        if (np_buckets.size() >= kBucketsMax) np_buckets.clear();
+    }
+    bucket &b = np_buckets.emplace(ip, bucket{np_accept_burst, now})
+                    .first->second;
+    b.tokens = min(np_accept_burst, b.tokens + (now - b.last) * per_ns);
+    b.last = now;
+    if (b.tokens < 1) return false;
+    b.tokens -= 1;
+    return true;
+}
+
+void report_accepts() {
+    const uint64_t now = tr_now();
+    if (now - np_reported < 1000000000) return;
+    np_reported = now;
+    ostringstream os;
+    os << "accept: " << np_accepted << " accepted, " << np_shed << " shed, "
+       << np_over << " over capacity\n";
+    const string msg = os.str();
+    write(tr_log_fd, msg.c_str(), msg.size());
+}
+
+// reset a connection turned away, without a TIME_WAIT left behind
+void shed(int csock) {
+    const struct linger reset = {1, 0};
+    setsockopt(csock, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+    close(csock);
+}
+
+// the next connection on lsock worth serving (peer address in caddr), or
+// -1 once the queue is empty
+int accept_client(int lsock, struct sockaddr_in &caddr) {
+    while (true) {
+        socklen_t clen = sizeof(caddr);
+        caddr.sin_family = AF_UNSPEC;
+        const int csock = accept4(lsock, (struct sockaddr *)&caddr, &clen,
+                                  SOCK_CLOEXEC);
+        if (csock == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return -1;
+        }
+        if (caddr.sin_family == AF_INET) {
+            if (!take_token(caddr.sin_addr.s_addr)) {
+                ++np_shed;
+                shed(csock);
+                report_accepts();
+                continue;
+            }
+            tune_socket(csock);
+        }
+        ++np_accepted;
+        return csock;
+    }
+}
+
+/* builtins
+   A builtin is one np_builtins entry: its name, how many words it takes
+   (missing ones are empty) and its handler, which also gets the rest of
+   the line and returns -1 to end the session. Lookup is a perfect hash
+   found at compile time: kBiSeed is the first seed that gives every name
+   its own slot in bi_table, so any command word costs one hash and at most
+   one compare. */
+typedef int (*builtin_fn)(const vector<string> &args, istream &rest);
+struct builtin {
+    const char *name;
+    int arity;
+    builtin_fn run;
+};
+
+// batch mode: no prompt while more lines are queued
+bool np_batch = false;
+
+int bi_setenv(const vector<string> &args, istream &rest) {
+    // synopsis: setenv [environment variable] [value to assign]
+    setenv(args[0].c_str(), args[1].c_str(), 1);
+    return 0;
+}
+
+int bi_printenv(const vector<string> &args, istream &rest) {
+    // synopsis: printenv [environment variable]
+    char *env = getenv(args[0].c_str());
+    if (env) cout << env << endl;
+    return 0;
+}
+
+int bi_exit(const vector<string> &args, istream &rest) {
+    // synopsis: exit
+    return -1;
+}
+
+int bi_batch(const vector<string> &args, istream &rest) {
+    // synopsis: batch [on|off]
+    if (args[0] == "on" || args[0] == "off") np_batch = args[0] == "on";
+    return 0;
+}
+
+int bi_name(const vector<string> &args, istream &rest) {
+    // synopsis: name [new username]
+    const string &arg = args[0];
+    bool found = false;
+    const char *name = arg.c_str();
+    char *np_name;
+    sem_wait(sem_name);
+    for (int shm_ni : shm_name) {
+        np_name = (char *)shmat(shm_ni, nullptr, 0);
+        if (strcmp(np_name, name) == 0) {
+            found = true;
+            shmdt(np_name);
+            break;
+        }
+        shmdt(np_name);
+    }
+    if (found) {
+        cout << "*** User '" << arg << "' already exists. ***" << endl;
+    } else {
+        np_name = (char *)shmat(shm_name[my_uid], nullptr, 0);
+        my_name = arg;
+        strcpy(np_name, name);
+        shmdt(np_name);
+        string msg = "*** User from " + my_address + " is named '" + arg +
+                     "'. ***\n";
+        broadcast(msg);
+    }
+    sem_signal(sem_name);
+    return 0;
+}
+
+int bi_who(const vector<string> &args, istream &rest) {
+    // synopsis: who
+    sem_wait(sem_pid);
+    sem_wait(sem_address);
+    sem_wait(sem_name);
+    int *np_pid = (int *)shmat(shm_pid, nullptr, 0);
+    char *np_address, *np_name;
+    cout << "<ID>\t<nickname>\t<IP/port>\t<indicate me>" << endl;
+    for (int i = 0; i < 30; ++i) {
+        if (np_pid[i] != -1) {
+            np_address = (char *)shmat(shm_address[i], nullptr, 0);
+            np_name = (char *)shmat(shm_name[i], nullptr, 0);
+            cout << i + 1 << '\t' << string(np_name) << '\t'
+                 << string(np_address);
+            if (i == my_uid) cout << "\t<-me";
+            cout << endl;
+            shmdt(np_address);
+            shmdt(np_name);
+        }
+    }
+    shmdt(np_pid);
+    sem_signal(sem_pid);
+    sem_signal(sem_address);
+    sem_signal(sem_name);
+    return 0;
+}
+
+int bi_tell(const vector<string> &args, istream &rest) {
+    // synopsis: tell [user id] [message]
+    int tuid = atoi(args[0].c_str()) - 1, tpid = -1;
+    string arg;
+    ws(rest);
+    getline(rest, arg);
+    if (tuid >= 0 && tuid < 30) {
+        sem_wait(sem_pid);
+        int *np_pid = (int *)shmat(shm_pid, nullptr, 0);
+        tpid = np_pid[tuid];
+        shmdt(np_pid);
+        sem_signal(sem_pid);
+    }
+    if (tpid == -1) {
+        cout << "*** Error: user #" << (tuid + 1) << " does not exist yet. ***"
+             << endl;
+    } else {
+        string msg = "*** " + my_name + " told you ***: " + arg + "\n";
+        sem_wait(sem_msg, tuid);
+        const uint64_t t = tr_now();
+        char *np_msg = (char *)shmat(shm_msg[tuid], nullptr, 0);
+        strcpy(np_msg, msg.c_str());
+        shmdt(np_msg);
+        kill(tpid, SIGUSR1);
+        tr_record(TR_WRITE, t);
+    }
+    return 0;
+}
+
+int bi_yell(const vector<string> &args, istream &rest) {
+    // synopsis: yell [message]
+    string arg;
+    ws(rest);
+    getline(rest, arg);
+    string msg = "*** " + my_name + " yelled ***: " + arg + "\n";
+    broadcast(msg);
+    return 0;
+}
+
+constexpr builtin np_builtins[] = {
+    {"setenv", 2, &bi_setenv}, {"printenv", 1, &bi_printenv},
+    {"exit", 0, &bi_exit},     {"batch", 1, &bi_batch},
+    {"name", 1, &bi_name},     {"who", 0, &bi_who},
+    {"tell", 1, &bi_tell},     {"yell", 0, &bi_yell},
+};
+constexpr size_t kBuiltins = sizeof(np_builtins) / sizeof(np_builtins[0]);
+// slots: a power of two, at least four per builtin
+constexpr unsigned bi_bits(unsigned b) {
+    return (1u << b) >= 4 * kBuiltins ? b : bi_bits(b + 1);
+}
+constexpr unsigned kBiBits = bi_bits(1), kBiSlots = 1u << kBiBits;
+
+// seeded FNV-1a; the constexpr form builds the table, the other looks up.
+// Slots come from the top bits, the only ones that depend on every byte.
+constexpr uint32_t bi_hash(const char *s, uint32_t h) {
+    return *s == '\0' ? h : bi_hash(s + 1, (h ^ uint8_t(*s)) * 16777619u);
+}
+uint32_t bi_hash(const string &s, uint32_t h) {
+    for (char c : s) h = (h ^ uint8_t(c)) * 16777619u;
+    return h;
+}
+constexpr unsigned bi_slot(size_t i, uint32_t seed) {
+    return bi_hash(np_builtins[i].name, seed) >> (32 - kBiBits);
+}
+// whether builtins i and j or any pair after them share a slot
+constexpr bool bi_collide(uint32_t seed, size_t i, size_t j) {
+    return i + 1 >= kBuiltins ? false
+           : j == kBuiltins   ? bi_collide(seed, i + 1, i + 2)
+                              : bi_slot(i, seed) == bi_slot(j, seed) ||
+                                  bi_collide(seed, i, j + 1);
+}
+// first collision-free seed in [lo, lo + n), or 0; halving keeps the
+// recursion shallow
+constexpr uint32_t bi_search(uint32_t lo, uint32_t n);
+constexpr uint32_t bi_or_search(uint32_t seed, uint32_t lo, uint32_t n) {
+    return seed != 0 ? seed : bi_search(lo, n);
+}
+constexpr uint32_t bi_search(uint32_t lo, uint32_t n) {
+    return n == 1 ? (bi_collide(lo, 0, 1) ? 0 : lo)
+                  : bi_or_search(bi_search(lo, n / 2), lo + n / 2, n - n / 2);
+}
+constexpr uint32_t kBiSeed = bi_search(1, 1 << 16);
+static_assert(kBiSeed != 0, "no perfect hash seed for np_builtins");
+// index of the builtin in slot s, or -1
+constexpr int bi_entry(unsigned s, size_t i) {
+    return i == kBuiltins                 ? -1
+           : bi_slot(i, kBiSeed) == s ? int(i)
+                                          : bi_entry(s, i + 1);
+}
+template <unsigned... I>
+struct bi_seq {};
+template <unsigned N, unsigned... I>
+struct bi_make_seq : bi_make_seq<N - 1, N - 1, I...> {};
+template <unsigned... I>
+struct bi_make_seq<0, I...> {
+    typedef bi_seq<I...> type;
+};
+struct bi_slots {
+    int8_t index[kBiSlots];
+};
+template <unsigned... I>
+constexpr bi_slots bi_make_table(bi_seq<I...>) {
+    return {{int8_t(bi_entry(I, 0))...}};
+}
+constexpr bi_slots bi_table = bi_make_table(bi_make_seq<kBiSlots>::type());
+
+const builtin *find_builtin(const string &cmd) {
+    const int i = bi_table.index[bi_hash(cmd, kBiSeed) >> (32 - kBiBits)];
+    return i >= 0 && cmd == np_builtins[i].name ? &np_builtins[i] : nullptr;
+}
+
+/* parsed pipelines
+   A line that is not a builtin is tokenized once and kept by its text,
+   least recently used first out, so running it again skips the
+   stringstream work. The parse depends on the text alone (who >* reaches
+   is looked up each run). argv arrays are built in the forked child,
+   which costs the session nothing. */
+struct pipeline {
+    // see npshell() for mode; file for mode 0, upouts (1-based) for 8
+    int mode, np, upin;
+    string file;
+    vector<int> upouts;
+    bool up_all;
+    vector<vector<string>> args;
+};
+const size_t kParseEntries = 256;
+list<pair<string, pipeline>> np_parsed;
+unordered_map<string, list<pair<string, pipeline>>::iterator> np_parsed_index;
+
+// the parse of line, valid until the next call
+const pipeline &parse_pipeline(const string &line) {
+    auto it = np_parsed_index.find(line);
+    if (it != np_parsed_index.end()) {
+        np_parsed.splice(np_parsed.begin(), np_parsed, it->second);
+        return it->second->second;
+    }
+    pipeline p;
+    p.mode = 10, p.np = -1, p.upin = -1, p.up_all = false;
+    stringstream ss(line);
+    string cmd, arg;
+    ss >> cmd;
+    // parse all commands and arguments
+    bool has_next = true;
+    while (has_next) {
+        has_next = false;
+        vector<string> argv = {cmd};
+        while (ss >> arg) {
+            if (arg == ">") {
+                p.mode = 0;
+                ss >> p.file;
+                break;
+            } else if (arg[0] == '>') {
+                // >N, or a multicast to >N,M,... or to everyone else (>*)
+                p.mode = 8;
+                p.upouts.clear();
+                p.up_all = arg == ">*";
+                stringstream list(arg.substr(1, arg.size() - 1));
+                string to;
+                while (!p.up_all && getline(list, to, ','))
+                    p.upouts.push_back(stoi(to));
+                continue;
+            } else if (arg[0] == '<') {
+                p.upin = stoi(arg.substr(1, arg.size() - 1));
+                assert(p.upin >= 0);
+                continue;
+            } else if (arg == "|") {
+                has_next = true;
+                ss >> cmd;
+                break;
+            } else if (arg[0] == '|' || arg[0] == '!') {
+                p.np = stoi(arg.substr(1, arg.size() - 1));
+                assert(p.np > 0);
+                p.mode = 20 + (arg[0] == '!' ? 1 : 0);
+                break;
+            }
+            argv.push_back(arg);
+        }
+        p.args.emplace_back(argv);
+    }
+    np_parsed.emplace_front(line, std::move(p));
+    np_parsed_index[line] = np_parsed.begin();
+    if (np_parsed.size() > kParseEntries) {
+        np_parsed_index.erase(np_parsed.back().first);
+        np_parsed.pop_back();
+    }
+    return np_parsed.front().second;
+}
+
 void npshell() {
     // default environment variables
     clearenv();
@@ -132,14 +856,24 @@ void npshell() {
     mode_t file_perm =
         S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
     // numbered pipe
-    int line, fd_table[2000][2];
+    int line = 0, fd_table[2000][2];
     for (int(&fd)[2] : fd_table) fd[0] = 0, fd[1] = 1;
     deque<int> pid_table[2000];
     // npshell
-    string cmd, arg;
+    string cmd;
     while (true) {
         // prompt string
-        cout << "% ";
+        if (!np_batch || !input_pending()) {
+            const uint64_t t = tr_now();
+            cout << "% " << flush;
+            tr_record(TR_WRITE, t);
+        }
+        tr_end();
+        // idle
+        if (!wait_input()) {
+            cout << "*** Idle timeout. ***" << endl;
+            break;
+        }
         // EOF
         while (!getline(cin, cmd)) {
             if (is_signaled) {
@@ -158,100 +892,12 @@ void npshell() {
         stringstream ss(cmd);
         ss >> cmd;
         if (cmd.empty()) continue;
+        tr_begin(my_uid, full_cmd);
         line = (line + 1) % 2000;
-        if (cmd == "setenv") {
-            // synopsis: setenv [environment variable] [value to assign]
-            ss >> cmd >> arg;
-            setenv(cmd.c_str(), arg.c_str(), 1);
-        } else if (cmd == "printenv") {
-            // synopsis: printenv [environment variable]
-            ss >> arg;
-            char *env = getenv(arg.c_str());
-            if (env) cout << env << endl;
-        } else if (cmd == "exit") {
-            // synopsis: exit
-            break;
-        } else if (cmd == "name") {
-            // synopsis: name [new username]
-            ss >> arg;
-            bool found = false;
-            const char *name = arg.c_str();
-            char *np_name;
-            sem_wait(sem_name);
-            for (int shm_ni : shm_name) {
-                np_name = (char *)shmat(shm_ni, nullptr, 0);
-                if (strcmp(np_name, name) == 0) {
-                    found = true;
-                    shmdt(np_name);
-                    break;
-                }
-                shmdt(np_name);
-            }
-            if (found) {
-                cout << "*** User '" << arg << "' already exists. ***" << endl;
-            } else {
-                np_name = (char *)shmat(shm_name[my_uid], nullptr, 0);
-                my_name = arg;
-                strcpy(np_name, name);
-                shmdt(np_name);
-                string msg = "*** User from " + my_address + " is named '" +
-                             arg + "'. ***\n";
-                broadcast(msg);
-            }
-            sem_signal(sem_name);
-        } else if (cmd == "who") {
-            // synopsis: who
-            sem_wait(sem_pid);
-            sem_wait(sem_address);
-            sem_wait(sem_name);
-            int *np_pid = (int *)shmat(shm_pid, nullptr, 0);
-            char *np_address, *np_name;
-            cout << "<ID>\t<nickname>\t<IP/port>\t<indicate me>" << endl;
-            for (int i = 0; i < 30; ++i) {
-                if (np_pid[i] != -1) {
-                    np_address = (char *)shmat(shm_address[i], nullptr, 0);
-                    np_name = (char *)shmat(shm_name[i], nullptr, 0);
-                    cout << i + 1 << '\t' << string(np_name) << '\t'
-                         << string(np_address);
-                    if (i == my_uid) cout << "\t<-me";
-                    cout << endl;
-                    shmdt(np_address);
-                    shmdt(np_name);
-                }
-            }
-            shmdt(np_pid);
-            sem_signal(sem_pid);
-            sem_signal(sem_address);
-            sem_signal(sem_name);
-        } else if (cmd == "tell") {
-            // synopsis: tell [user id] [message]
-            int tuid, tpid;
-            ss >> tuid;
-            --tuid;
-            ws(ss);
-            getline(ss, arg);
-            sem_wait(sem_pid);
-            int *np_pid = (int *)shmat(shm_pid, nullptr, 0);
-            tpid = np_pid[tuid];
-            shmdt(np_pid);
-            sem_signal(sem_pid);
-            if (tpid == -1) {
-                cout << "*** Error: user #" << (tuid + 1)
-                     << " does not exist yet. ***" << endl;
-            } else {
-                string msg = "*** " + my_name + " told you ***: " + arg + "\n";
-                sem_wait(sem_msg, tuid);
-                char *np_msg = (char *)shmat(shm_msg[tuid], nullptr, 0);
-                strcpy(np_msg, msg.c_str());
-                shmdt(np_msg);
-                kill(tpid, SIGUSR1);
-            }
-        } else if (cmd == "yell") {
-            // synopsis: yell [message]
-            ws(ss);
-            getline(ss, arg);
-            string msg = "*** " + my_name + " yelled ***: " + arg + "\n";
-            broadcast(msg);
+        if (const builtin *bi = find_builtin(cmd)) {
+            vector<string> args(bi->arity);
+            for (string &a : args) ss >> a;
+            if (bi->run(args, ss) == -1) break;
         } else {
             /* mode
              0: stdout to overwrite file
@@ -260,41 +906,12 @@ void npshell() {
              20: stdout numbered pipe
              21: stdout stderr numbered pipe
             */
-            int mode = 10, np = -1, upin = -1, upout = -1;
-            // parse all commands and arguments
-            vector<vector<string>> args;
-            bool has_next = true;
-            while (has_next) {
-                has_next = false;
-                vector<string> argv = {cmd};
-                while (ss >> arg) {
-                    if (arg == ">") {
-                        mode = 0;
-                        ss >> cmd;
-                        break;
-                    } else if (arg[0] == '>') {
-                        mode = 8;
-                        upout = stoi(arg.substr(1, arg.size() - 1));
-                        assert(upout >= 0);
-                        continue;
-                    } else if (arg[0] == '<') {
-                        upin = stoi(arg.substr(1, arg.size() - 1));
-                        assert(upin >= 0);
-                        continue;
-                    } else if (arg == "|") {
-                        has_next = true;
-                        ss >> cmd;
-                        break;
-                    } else if (arg[0] == '|' || arg[0] == '!') {
-                        np = stoi(arg.substr(1, arg.size() - 1));
-                        assert(np > 0);
-                        mode = 20 + (arg[0] == '!' ? 1 : 0);
-                        break;
-                    }
-                    argv.push_back(arg);
-                }
-                args.emplace_back(argv);
-            }
+            const pipeline &p = parse_pipeline(full_cmd);
+            const vector<vector<string>> &args = p.args;
+            int mode = p.mode, np = p.np, upin = p.upin;
+            vector<int> upouts = p.upouts;
+            const bool up_all = p.up_all;
+            tr_record(TR_PARSE, tr_start);
             // enqueue previous pid
             int nline = (line + np) % 2000;
             pid_table[nline].insert(pid_table[nline].begin(),
@@ -336,38 +953,68 @@ void npshell() {
                 }
                 sem_signal(sem_pid);
             }
-            if (upout != -1) {
-                --upout;
-                bool found = false;
+            /* multicast
+               Every receiver gets a name for the same file: the first
+               one is created as for >N and the others are hard links to
+               it, so the output is written once. A receiver removing its
+               name does not affect the others. */
+            if (mode == 8) {
                 sem_wait(sem_pid);
                 int *np_pid = (int *)shmat(shm_pid, nullptr, 0);
-                if (np_pid[upout] != -1) found = true;
+                if (up_all) {
+                    for (int to = 0; to < 30; ++to)
+                        if (np_pid[to] != -1 && to != my_uid)
+                            upouts.push_back(to + 1);
+                }
+                sort(upouts.begin(), upouts.end());
+                upouts.erase(unique(upouts.begin(), upouts.end()),
+                             upouts.end());
+                string error;
+                if (upouts.empty())
+                    error = "*** Error: no other user is online. ***";
+                for (int &upout : upouts) {
+                    --upout;
+                    string up_name =
+                        "user_pipe/" + to_string(my_uid * 30 + upout) + ".txt";
+                    if (!error.empty()) {
+                        continue;
+                    } else if (upout < 0 || upout >= 30 ||
+                               np_pid[upout] == -1) {
+                        error = "*** Error: user #" + to_string(upout + 1) +
+                                " does not exist yet. ***";
+                    } else if (access(up_name.c_str(), F_OK) != -1) {
+                        error = "*** Error: the pipe #" +
+                                to_string(my_uid + 1) + "->#" +
+                                to_string(upout + 1) + " already exists. ***";
+                    }
+                }
                 shmdt(np_pid);
-                string up_name =
-                    "user_pipe/" + to_string(my_uid * 30 + upout) + ".txt";
-                if (upout > 30 || !found) {
-                    cout << "*** Error: user #" << (upout + 1)
-                         << " does not exist yet. ***" << endl;
+                if (!error.empty()) {
+                    sem_signal(sem_pid);
+                    cout << error << endl;
                     continue;
-                } else if (access(up_name.c_str(), F_OK) != -1) {
-                    cout << "*** Error: the pipe #" << (my_uid + 1) << "->#"
-                         << (upout + 1) << " already exists. ***" << endl;
-                    continue;
-                } else {
-                    sem_wait(sem_name);
+                }
+                sem_wait(sem_name);
+                for (int upout : upouts) {
                     char *np_name = (char *)shmat(shm_name[upout], nullptr, 0);
                     string msg = "*** " + my_name + " (#" +
                                  to_string(my_uid + 1) + ") just piped '" +
                                  full_cmd + "' to " + string(np_name) + " (#" +
                                  to_string(upout + 1) + ") ***\n";
                     bmsg += msg;
-                    // broadcast(msg);
-                    // open output file
-                    fd_table[nline][1] =
-                        open(up_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
-                             file_perm);
                     shmdt(np_name);
-                    sem_signal(sem_name);
+                }
+                sem_signal(sem_name);
+                // open output file
+                const string up_name =
+                    "user_pipe/" + to_string(my_uid * 30 + upouts[0]) + ".txt";
+                fd_table[nline][1] = open(
+                    up_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, file_perm);
+                for (size_t i = 1; i < upouts.size(); ++i) {
+                    const string link_name =
+                        "user_pipe/" + to_string(my_uid * 30 + upouts[i]) +
+                        ".txt";
+                    link(up_name.c_str(), link_name.c_str());
                 }
                 sem_signal(sem_pid);
             }
@@ -375,7 +1022,8 @@ void npshell() {
             if (mode == 0) {
                 // 0: open file
                 fd_table[nline][1] =
-                    open(cmd.c_str(), O_WRONLY | O_CREAT | O_TRUNC, file_perm);
+                    open(p.file.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                         file_perm);
             } else if (mode == 20 || mode == 21) {
                 // 20, 21: open numbered pipe
                 if (!IS_PIPE(fd_table[nline][0]))
@@ -394,7 +1042,9 @@ void npshell() {
             }
             // wait for current line
             if (mode < 20) {
+                const uint64_t t = tr_now();
                 for (int p : pid_table[nline]) waitpid(p, nullptr, 0);
+                tr_record(TR_WAIT, t);
             }
             // cleanup current line
             fd_table[line][0] = 0;
@@ -426,14 +1076,15 @@ void cleanIPC(int sig) {
 
 void show_msg(int sig) {
     char *np_msg = (char *)shmat(shm_msg[my_uid], nullptr, 0);
-    cout << string(np_msg);
+    // out now: the read it interrupted may be restarted, or be a poll()
+    cout << string(np_msg) << flush;
     shmdt(np_msg);
     sem_signal(sem_msg, my_uid);
     is_signaled = true;
 }
 
 int initialize_uid() {
-    int ret;
+    int ret = -1;
     sem_wait(sem_pid);
     int *np_pid = (int *)shmat(shm_pid, nullptr, 0);
     for (size_t i = 0; i < 30; ++i) {
@@ -447,6 +1098,81 @@ int initialize_uid() {
     return ret;
 }
 
+/* slots of sessions that died without logging out (crashed, or killed
+   after a dead peer): free the slot, release senders blocked on its
+   message semaphore and remove its user pipes. The SIGCHLD reaper has
+   already collected the process, so kill(pid, 0) finds nothing. */
+void reclaim_sessions() {
+    sem_wait(sem_pid);
+    int *np_pid = (int *)shmat(shm_pid, nullptr, 0);
+    for (int uid = 0; uid < 30; ++uid) {
+        if (np_pid[uid] == -1 || kill(np_pid[uid], 0) == 0 || errno != ESRCH)
+            continue;
+        // its commands, left in its group; the id stays taken while any run
+        killpg(np_pid[uid], SIGKILL);
+        np_pid[uid] = -1;
+        sem_wait(sem_name);
+        char *np_name = (char *)shmat(shm_name[uid], nullptr, 0);
+        strcpy(np_name, "(no name)");
+        shmdt(np_name);
+        sem_signal(sem_name);
+        semctl(sem_msg, uid, SETVAL, 1);
+        for (int i = 0; i < 30; ++i) {
+            string iu_name = "user_pipe/" + to_string(i * 30 + uid) + ".txt",
+                   ui_name = "user_pipe/" + to_string(uid * 30 + i) + ".txt";
+            remove(iu_name.c_str());
+            remove(ui_name.c_str());
+        }
+    }
+    shmdt(np_pid);
+    sem_signal(sem_pid);
+}
+
+/* optional AF_UNIX listener next to the TCP one
+   NP_UNIX_PATH: socket path; a stale socket left there is replaced
+   NP_UNIX_MODE: its permissions in octal (default 0666) */
+int unix_listener(int backlog) {
+    const char *path = getenv("NP_UNIX_PATH");
+    if (path == nullptr || *path == '\0') return -1;
+    struct sockaddr_un uaddr;
+    memset(&uaddr, 0, sizeof(uaddr));
+    uaddr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(uaddr.sun_path)) {
+        cerr << "NP_UNIX_PATH too long: " << path << endl;
+        return -1;
+    }
+    strcpy(uaddr.sun_path, path);
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+    int usock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (bind(usock, (struct sockaddr *)&uaddr, sizeof(uaddr)) == -1) {
+        cerr << "bind " << path << ": " << strerror(errno) << endl;
+        close(usock);
+        return -1;
+    }
+    const char *mode = getenv("NP_UNIX_MODE");
+    chmod(path, mode != nullptr ? strtol(mode, nullptr, 8) : 0666);
+    listen(usock, backlog);
+    return usock;
+}
+
+// listener with a pending connection, or -1 after a signal (a session
+// exiting) or a second without one, so dead sessions get reclaimed
+int next_listener(int ssock, int usock) {
+    struct pollfd pfd[2] = {{ssock, POLLIN, 0}, {usock, POLLIN, 0}};
+    if (poll(pfd, usock == -1 ? 1 : 2, 1000) <= 0) return -1;
+    return usock != -1 && pfd[1].revents & POLLIN ? usock : ssock;
+}
+
+// who a local peer is: "unix/<uid>/<pid>" from SO_PEERCRED
+string peer_credentials(int csock) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(csock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+        return "unix/?";
+    return "unix/" + to_string(cred.uid) + "/" + to_string(cred.pid);
+}
+
 int main(int argc, char **argv) {
     // shared memory
     const int ipcflag = IPC_CREAT | 0666;
@@ -475,7 +1201,7 @@ int main(int argc, char **argv) {
     sigaction(SIGINT, &sa_sigterm, nullptr);
     sigaction(SIGTERM, &sa_sigterm, nullptr);
     // server socket
-    int ssock = socket(AF_INET, SOCK_STREAM, 0);
+    int ssock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     int on = 1;
     setsockopt(ssock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
     setsockopt(ssock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
@@ -491,52 +1217,102 @@ int main(int argc, char **argv) {
         saddr.sin_port = htons(5566);
     }
     bind(ssock, (struct sockaddr *)&saddr, sizeof(saddr));
-    listen(ssock, 5);
+    // connection storms
+    if (const char *v = getenv("NP_BACKLOG")) np_backlog = atoi(v);
+    if (const char *v = getenv("NP_ACCEPT_RATE")) np_accept_rate = atof(v);
+    if (const char *v = getenv("NP_ACCEPT_BURST")) np_accept_burst = atof(v);
+    if (const char *v = getenv("NP_DEFER_ACCEPT")) np_defer_accept = atoi(v);
+    listen(ssock, np_backlog);
+    if (np_defer_accept > 0) {
+        setsockopt(ssock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &np_defer_accept,
+                   sizeof(np_defer_accept));
+    }
+    int usock = unix_listener(np_backlog);
     // reap client child
     struct sigaction sa_sigchld;
     sa_sigchld.sa_handler = &reaper;
     sigemptyset(&sa_sigchld.sa_mask);
     sa_sigchld.sa_flags = SA_RESTART | SA_NOCLDSTOP;
     sigaction(SIGCHLD, &sa_sigchld, nullptr);
-    // accept client
+    // per-session cgroups
+    cg_init();
+    // tracing
+    const char *slow_ms = getenv("NP_TRACE_SLOW_MS");
+    if (slow_ms != nullptr) tr_slow_ns = atof(slow_ms) * 1e6;
+    struct sigaction sa_dump;
+    sa_dump.sa_handler = &tr_dump;
+    sigemptyset(&sa_dump.sa_mask);
+    sa_dump.sa_flags = SA_RESTART;
+    sigaction(SIGUSR2, &sa_dump, nullptr);
+    // dead peers and idle sessions
+    if (const char *v = getenv("NP_KEEPALIVE")) np_keepalive = atoi(v);
+    if (const char *v = getenv("NP_USER_TIMEOUT")) np_user_timeout = atoi(v);
+    if (const char *v = getenv("NP_IDLE_TIMEOUT")) np_idle_timeout = atof(v);
+    // teardown
+    if (const char *v = getenv("NP_KILL_GRACE")) np_kill_grace = atof(v);
+    np_server_pgid = getpgrp();
+    // a message to a session not yet listening for it waits, instead of
+    // killing it
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &usr1, nullptr);
+    // accept clients, the whole queue per wakeup
     int csock, pid, uid;
     char cip[INET_ADDRSTRLEN];
-    socklen_t clen = sizeof(caddr);
     string address;
     while (true) {
-        csock = accept(ssock, (struct sockaddr *)&caddr, &clen);
-        inet_ntop(AF_INET, &caddr.sin_addr, cip, INET_ADDRSTRLEN);
-        // address = string(cip) + "/" + to_string(htons(caddr.sin_port));
-        address = "CGILAB/511";
-        uid = initialize_uid();
-        // shm_name
-        sem_wait(sem_name);
-        char *np_name = (char *)shmat(shm_name[uid], nullptr, 0);
-        strcpy(np_name, "(no name)");
-        shmdt(np_name);
-        sem_signal(sem_name);
-        // shm_address
-        sem_wait(sem_address);
-        char *np_address = (char *)shmat(shm_address[uid], nullptr, 0);
-        strcpy(np_address, address.c_str());
-        shmdt(np_address);
-        sem_signal(sem_address);
-        // shm_pid
-        sem_wait(sem_pid);
-        // grant 1 to sem_msg
-        semctl(sem_msg, uid, SETVAL, 1);
-        // fork client
-        if ((pid = fork()) == 0) {
-            close(ssock);
-            break;
+        reclaim_sessions();
+        const int lsock = next_listener(ssock, usock);
+        if (lsock == -1) continue;
+        while ((csock = accept_client(lsock, caddr)) != -1) {
+            if (lsock == usock) {
+                address = peer_credentials(csock);
+            } else {
+                inet_ntop(AF_INET, &caddr.sin_addr, cip, INET_ADDRSTRLEN);
+                // address = string(cip) + "/" +
+                //           to_string(htons(caddr.sin_port));
+                address = "CGILAB/511";
+            }
+            uid = initialize_uid();
+            if (uid == -1) {
+                ++np_over;
+                report_accepts();
+                close(csock);
+                continue;
+            }
+            // shm_name
+            sem_wait(sem_name);
+            char *np_name = (char *)shmat(shm_name[uid], nullptr, 0);
+            strcpy(np_name, "(no name)");
+            shmdt(np_name);
+            sem_signal(sem_name);
+            // shm_address
+            sem_wait(sem_address);
+            char *np_address = (char *)shmat(shm_address[uid], nullptr, 0);
+            strcpy(np_address, address.c_str());
+            shmdt(np_address);
+            sem_signal(sem_address);
+            // shm_pid
+            sem_wait(sem_pid);
+            // grant 1 to sem_msg
+            semctl(sem_msg, uid, SETVAL, 1);
+            // fork client
+            if ((pid = fork()) == 0) {
+                close(ssock);
+                if (usock != -1) close(usock);
+                break;
+            }
+            close(csock);
+            int *np_pid = (int *)shmat(shm_pid, nullptr, 0);
+            np_pid[uid] = pid;
+            shmdt(np_pid);
+            sem_signal(sem_pid);
         }
-        close(csock);
-        int *np_pid = (int *)shmat(shm_pid, nullptr, 0);
-        np_pid[uid] = pid;
-        shmdt(np_pid);
-        sem_signal(sem_pid);
+        if (csock != -1) break;
     }
     // client npshell
+    tr_log_fd = fcntl(2, F_DUPFD_CLOEXEC, 3);
     dup2(csock, 0);
     dup2(csock, 1);
     dup2(csock, 2);
@@ -544,10 +1320,18 @@ int main(int argc, char **argv) {
     my_uid = uid;
     my_address = address;
     my_name = "(no name)";
+    // a client gone mid-write must not skip the logout below
+    signal(SIGPIPE, SIG_IGN);
+    // a group for the commands to come, ended at logout
+    setpgid(0, 0);
+    // per-session cgroup
+    cg_open();
     struct sigaction sa_sigusr1;
     sa_sigusr1.sa_handler = &show_msg;
     sigemptyset(&sa_sigusr1.sa_mask);
+    sa_sigusr1.sa_flags = 0;
     sigaction(SIGUSR1, &sa_sigusr1, nullptr);
+    sigprocmask(SIG_UNBLOCK, &usr1, nullptr);
     cout << "****************************************" << endl
          << "** Welcome to the information server. **" << endl
          << "****************************************" << endl;
@@ -570,7 +1354,8 @@ int main(int argc, char **argv) {
     np_pid[uid] = -1;
     shmdt(np_pid);
     sem_signal(sem_pid);
-    // TODO: wait or kill
+    // commands still running
+    end_commands();
     // cleanup pipe
     for (size_t i = 0; i < 30; ++i) {
         string iu_name = "user_pipe/" + to_string(i * 30 + my_uid) + ".txt",
@@ -578,4 +1363,5 @@ int main(int argc, char **argv) {
         remove(iu_name.c_str());
         remove(ui_name.c_str());
     }
+    cg_close();
 }
@@ -1,22 +1,318 @@
 #include <arpa/inet.h>
+#include <dirent.h>
 #include <fcntl.h>
+#include <linux/io_uring.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <deque>
+#include <fstream>
 #include <iostream>
+#include <list>
 #include <map>
+#include <set>
 #include <sstream>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #define IS_PIPE(x) ((x) > 2)
 using namespace std;
 
+/* tracing
+   Spans of the command being run go into a fixed ring. A slot's seq is 0
+   while it is written and its index + 1 after, so the SIGUSR2 dump (which
+   may interrupt a write) skips torn slots without locking. Commands slower
+   than NP_TRACE_SLOW_MS are logged with their breakdown. */
+enum { TR_CMD, TR_PARSE, TR_PIPE_WAIT, TR_FORK, TR_WAIT, TR_WRITE, TR_KINDS };
+const char *const tr_names[TR_KINDS] = {"command", "parse", "pipe_wait",
+                                        "fork",    "wait",  "write"};
+struct tr_span {
+    volatile uint64_t seq;
+    uint64_t start, dur;
+    int uid, kind, stage;
+    char text[48];
+};
+const uint64_t kTrRing = 4096;
+tr_span tr_ring[kTrRing];
+uint64_t tr_head = 0;
+// current command
+bool tr_active = false;
+int tr_uid = -1;
+string tr_cmd;
+uint64_t tr_start, tr_total[TR_KINDS];
+// NP_TRACE_SLOW_MS (0 disables the log) and where it goes
+uint64_t tr_slow_ns = 0;
+int tr_log_fd = 2;
+
+uint64_t tr_now() {
+    // vDSO, no syscall
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void tr_record(int kind, uint64_t start, int stage = -1,
+               const char *text = nullptr) {
+    if (!tr_active) return;
+    const uint64_t end = tr_now();
+    tr_total[kind] += end - start;
+    tr_span &s = tr_ring[tr_head % kTrRing];
+    s.seq = 0;
+    atomic_signal_fence(memory_order_seq_cst);
+    s.start = start;
+    s.dur = end - start;
+    s.uid = tr_uid;
+    s.kind = kind;
+    s.stage = stage;
+    strncpy(s.text, text ? text : "", sizeof(s.text) - 1);
+    s.text[sizeof(s.text) - 1] = '\0';
+    atomic_signal_fence(memory_order_seq_cst);
+    s.seq = ++tr_head;
+}
+
+void tr_begin(int uid, const string &cmd) {
+    tr_active = true;
+    tr_uid = uid;
+    tr_cmd = cmd;
+    tr_start = tr_now();
+    for (uint64_t &t : tr_total) t = 0;
+}
+
+void tr_end() {
+    if (!tr_active) return;
+    tr_record(TR_CMD, tr_start, -1, tr_cmd.c_str());
+    tr_active = false;
+    const uint64_t dur = tr_total[TR_CMD];
+    if (tr_slow_ns == 0 || dur < tr_slow_ns) return;
+    ostringstream os;
+    os.setf(ios::fixed);
+    os.precision(3);
+    os << "slow command: uid " << tr_uid << " pid " << getpid() << " "
+       << dur / 1e6 << " ms '" << tr_cmd << "':";
+    for (int k = TR_PARSE; k < TR_KINDS; ++k)
+        os << ' ' << tr_names[k] << '=' << tr_total[k] / 1e6;
+    os << '\n';
+    const string msg = os.str();
+    write(tr_log_fd, msg.c_str(), msg.size());
+}
+
+// async-signal-safe text buffer for the dump
+struct tr_out {
+    int fd;
+    size_t len;
+    char buf[4096];
+    void flush() {
+        write(fd, buf, len);
+        len = 0;
+    }
+    void put(const char *s) {
+        for (; *s; ++s) put(*s);
+    }
+    void put(char c) {
+        if (len == sizeof(buf)) flush();
+        buf[len++] = c;
+    }
+    void put(uint64_t n) {
+        char tmp[24], *p = tmp + sizeof(tmp);
+        *--p = '\0';
+        do *--p = '0' + n % 10;
+        while ((n /= 10) != 0);
+        put(p);
+    }
+    // nanoseconds as fractional microseconds
+    void put_us(uint64_t ns) {
+        put(ns / 1000);
+        put('.');
+        put(char('0' + ns / 100 % 10));
+        put(char('0' + ns / 10 % 10));
+        put(char('0' + ns % 10));
+    }
+    void put_json(const char *s) {
+        for (; *s; ++s) {
+            if (*s == '"' || *s == '\\') put('\\');
+            put((unsigned char)*s < 0x20 ? '?' : *s);
+        }
+    }
+};
+
+// SIGUSR2: write the ring as a Chrome/Perfetto trace to np_trace.<pid>.json
+void tr_dump(int sig) {
+    const int saved_errno = errno;
+    static tr_out out;
+    char path[40] = "np_trace.", *p = path + 9, digits[16];
+    int n = 0;
+    for (pid_t pid = getpid(); pid != 0; pid /= 10) digits[n++] = '0' + pid % 10;
+    while (n > 0) *p++ = digits[--n];
+    strcpy(p, ".json");
+    out.len = 0;
+    out.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out.fd == -1) {
+        errno = saved_errno;
+        return;
+    }
+    out.put("{\"traceEvents\":[");
+    const uint64_t head = tr_head;
+    const char *sep = "\n";
+    for (uint64_t i = head > kTrRing ? head - kTrRing : 0; i < head; ++i) {
+        const tr_span &slot = tr_ring[i % kTrRing];
+        if (slot.seq != i + 1) continue;
+        tr_span s;
+        memcpy(&s, (const void *)&slot, sizeof(s));
+        atomic_signal_fence(memory_order_seq_cst);
+        if (slot.seq != i + 1) continue;
+        out.put(sep);
+        sep = ",\n";
+        out.put("{\"name\":\"");
+        out.put(tr_names[s.kind]);
+        out.put("\",\"ph\":\"X\",\"ts\":");
+        out.put_us(s.start);
+        out.put(",\"dur\":");
+        out.put_us(s.dur);
+        out.put(",\"pid\":");
+        out.put(uint64_t(getpid()));
+        out.put(",\"tid\":");
+        out.put(uint64_t(s.uid + 1));
+        out.put(",\"args\":{");
+        if (s.stage >= 0) {
+            out.put("\"stage\":");
+            out.put(uint64_t(s.stage));
+            out.put(',');
+        }
+        out.put("\"text\":\"");
+        out.put_json(s.text);
+        out.put("\"}}");
+    }
+    out.put("\n]}\n");
+    out.flush();
+    close(out.fd);
+    errno = saved_errno;
+}
+
+// signal mask outside the event loops' waits; SIGHUP is blocked elsewhere
+sigset_t np_sigmask;
+
+/* children reaped in the background by the io_uring backend
+   np_reaped: reaped but not yet waited for
+   np_lost: waited for (ECHILD) before the completion arrived
+   A pid showing up again in fork() is a new process, so both forget it. */
+bool np_waitid = false, np_waitid_armed = false;
+unordered_multiset<int> np_reaped, np_lost;
+void uring_waitid();
+
+void child_forked(int pid) {
+    np_reaped.erase(pid);
+    np_lost.erase(pid);
+    if (np_waitid && !np_waitid_armed) uring_waitid();
+}
+
+void child_reaped(int pid) {
+    auto it = np_lost.find(pid);
+    if (it != np_lost.end()) {
+        np_lost.erase(it);
+    } else {
+        np_reaped.insert(pid);
+    }
+}
+
+void wait_child(int pid) {
+    auto it = np_reaped.find(pid);
+    if (it != np_reaped.end()) {
+        np_reaped.erase(it);
+    } else if (waitpid(pid, nullptr, 0) == -1 && errno == ECHILD &&
+               np_waitid) {
+        np_lost.insert(pid);
+    }
+}
+
+/* teardown
+   Every command leads its own process group, so signaling the group also
+   reaches whatever the command started. Commands a session leaves behind
+   (writers of pipes nobody will read now) get SIGTERM, then SIGKILL if
+   they are still running NP_KILL_GRACE ms (default 500) later. The event
+   loops reap them and wake up for the deadlines, so a slow one never
+   stalls other sessions. A group is only signaled while its leader is
+   unreaped, so its id cannot have been reused. */
+uint64_t np_kill_grace_ns = 500000000;
+// (deadline, pid), earliest first
+deque<pair<uint64_t, int>> np_doomed;
+// left to finish on their own, reaped when they do
+vector<int> np_detached;
+
+void doom(deque<int> &pids) {
+    const uint64_t deadline = tr_now() + np_kill_grace_ns;
+    for (int pid : pids) {
+        auto it = np_reaped.find(pid);
+        if (it != np_reaped.end()) {
+            np_reaped.erase(it);
+            continue;
+        }
+        killpg(pid, SIGTERM);
+        np_doomed.emplace_back(deadline, pid);
+    }
+    pids.clear();
+}
+
+// reap what has exited and kill what is past its grace period (everything
+// with all); ns until the next deadline, or -1 when nothing is left
+int64_t reap_doomed(bool all = false) {
+    const uint64_t now = tr_now();
+    size_t kept = 0;
+    for (int pid : np_detached) {
+        auto r = np_reaped.find(pid);
+        if (r != np_reaped.end()) {
+            np_reaped.erase(r);
+        } else if (const int ret = waitpid(pid, nullptr, WNOHANG)) {
+            if (ret == -1 && errno == ECHILD && np_waitid) np_lost.insert(pid);
+        } else {
+            np_detached[kept++] = pid;
+        }
+    }
+    np_detached.resize(kept);
+    for (auto it = np_doomed.begin(); it != np_doomed.end();) {
+        const int pid = it->second;
+        auto r = np_reaped.find(pid);
+        if (r != np_reaped.end()) {
+            np_reaped.erase(r);
+        } else if (const int ret = waitpid(pid, nullptr, WNOHANG)) {
+            // reaped behind our back: the completion is still to come
+            if (ret == -1 && errno == ECHILD && np_waitid) np_lost.insert(pid);
+        } else if (all || it->first <= now) {
+            killpg(pid, SIGKILL);
+            wait_child(pid);
+        } else {
+            ++it;
+            continue;
+        }
+        it = np_doomed.erase(it);
+    }
+    if (np_doomed.empty()) return -1;
+    return max(int64_t(np_doomed.front().first - now), int64_t(0));
+}
+
+// the earlier of two waits, where -1 is forever
+int64_t sooner(int64_t a, int64_t b) {
+    return a < 0 ? b : b < 0 ? a : min(a, b);
+}
+
 void convert(const vector<string> &from, vector<char *> &to) {
     // convert vector of c++ string to vector of c string
     auto it_end = from.end();
@@ -26,6 +322,7 @@ void convert(const vector<string> &from, vector<char *> &to) {
 }
 
 void mywait(deque<int> &pid) {
+    const uint64_t t = tr_now();
     int p;
     bool has_wait = false;
     // clean up finished process
@@ -33,12 +330,49 @@ void mywait(deque<int> &pid) {
         pid.erase(std::remove(pid.begin(), pid.end(), p), pid.end());
         has_wait = true;
     }
-    if (has_wait) return;
     // wait for the front of deque
-    if (!pid.empty()) {
-        waitpid(pid.front(), nullptr, 0);
+    if (!has_wait && !pid.empty()) {
+        wait_child(pid.front());
         pid.pop_front();
     }
+    tr_record(TR_PIPE_WAIT, t);
+}
+
+void cg_enter();
+
+/* fd hygiene
+   Every fd the server opens is close-on-exec, and commands also get
+   close_range(3, ~0) before exec, so nothing but stdin, stdout and stderr
+   reaches them: no other user's socket or pipe, whose readers would
+   otherwise wait for the command to exit before seeing EOF. With
+   NP_FD_CHECK=1 each command first lists on the server's stderr the fds it
+   would have inherited without close_range (those missing FD_CLOEXEC). */
+bool np_fd_check = false;
+
+void fd_check(const string &cmd) {
+    DIR *dir = opendir("/proc/self/fd");
+    if (dir == nullptr) return;
+    while (struct dirent *e = readdir(dir)) {
+        const int fd = atoi(e->d_name);
+        if (e->d_name[0] == '.' || fd <= 2 || fd == dirfd(dir)) continue;
+        if (fcntl(fd, F_GETFD) & FD_CLOEXEC) continue;
+        char target[256];
+        const string link = "/proc/self/fd/" + string(e->d_name);
+        const ssize_t n = readlink(link.c_str(), target, sizeof(target));
+        ostringstream os;
+        os << "fd check: " << cmd << " inherits fd " << fd << " ("
+           << string(target, max(n, ssize_t(0))) << ")\n";
+        const string msg = os.str();
+        write(tr_log_fd, msg.c_str(), msg.size());
+    }
+    closedir(dir);
+}
+
+// with the server's fds
+void set_cloexec(int fd, bool on) {
+    const int flags = fcntl(fd, F_GETFD);
+    if (flags != -1)
+        fcntl(fd, F_SETFD, on ? flags | FD_CLOEXEC : flags & ~FD_CLOEXEC);
 }
 
 void exec(const vector<vector<string>> &args, deque<int> &pidout, int fdin,
@@ -50,10 +384,16 @@ void exec(const vector<vector<string>> &args, deque<int> &pidout, int fdin,
     for (i = 0; i < len; ++i) {
         cur = i & 1;
         if (i != len - 1) {
-            while (pipe(fd[cur]) == -1) mywait(pidout);
+            while (pipe2(fd[cur], O_CLOEXEC) == -1) mywait(pidout);
         }
+        const uint64_t t = tr_now();
         while ((pid[cur] = fork()) == -1) mywait(pidout);
         if (pid[cur] == 0) {
+            // the server's signal setup is not the command's
+            signal(SIGPIPE, SIG_DFL);
+            sigprocmask(SIG_SETMASK, &np_sigmask, nullptr);
+            setpgid(0, 0);
+            cg_enter();
             // fd[0] -> stdin
             if (i != 0) {
                 close(fd[1 - cur][1]);
@@ -69,12 +409,21 @@ void exec(const vector<vector<string>> &args, deque<int> &pidout, int fdin,
                 dup2(fdout, 1);
                 if (mode == 21) dup2(fdout, 2);
             }
+            // only stdin, stdout and stderr go to the command
+            if (np_fd_check) fd_check(args[i][0]);
+#ifdef SYS_close_range
+            syscall(SYS_close_range, 3, ~0u, 0);
+#endif
             vector<char *> arg;
             convert(args[i], arg);
             execvp(arg[0], &arg[0]);
             cerr << "Unknown command: [" << arg[0] << "]." << endl;
             exit(0);
         }
+        tr_record(TR_FORK, t, i, args[i][0].c_str());
+        // also here, so the group exists before anyone signals it
+        setpgid(pid[cur], pid[cur]);
+        child_forked(pid[cur]);
         pidout.push_back(pid[cur]);
         if (i != 0) {
             close(fd[1 - cur][0]);
@@ -92,66 +441,720 @@ int stdfd[3];
 int np_user[30];
 string np_name[30], np_address[30];
 // npshell
-int np_line[30];
 map<string, string> np_env[30];
-// numbered pipe
-int np_fd_table[30][2000][2];
-deque<int> np_pid_table[30][2000];
-// user pipe
-int np_user_pipe[30][30][2];
-deque<int> np_up_pid[30][30];
-int initialize(int csock) {
-    int uid = -1;
-    for (size_t i = 0; i < 30; ++i) {
-        if (np_user[i] == -1) {
-            np_user[i] = csock;
-            uid = i;
+/* sessions
+   A user's pipes live in one slot of the preallocated np_sessions pool,
+   taken at login and handed back clean at logout. Numbered pipes and the
+   pids writing to them are kept by target line, user pipes by receiver
+   (pipe_in[sender]). Each session also records which of them are live
+   (lines in live_lines, senders in pipes_in, receivers in pipes_out), so
+   login and logout only touch what the user actually holds. */
+struct session {
+    int line;
+    int fd_table[2000][2];
+    deque<int> pid_table[2000];
+    set<int> live_lines;
+    int pipe_in[30][2];
+    deque<int> pipe_pids[30];
+    uint32_t pipes_in, pipes_out;
+    session() : line(1), pipes_in(0), pipes_out(0) {
+        for (int(&fd)[2] : fd_table) fd[0] = 0, fd[1] = 1;
+        for (int(&fd)[2] : pipe_in) fd[0] = 0, fd[1] = 1;
+    }
+};
+session np_sessions[30];
+// free slots; the lowest is the next uid
+uint32_t np_free = (1u << 30) - 1;
+
+// close the numbered pipe of line and forget the pids writing to it
+void drop_line(session &s, int line) {
+    int(&fd)[2] = s.fd_table[line];
+    if (IS_PIPE(fd[0])) close(fd[0]);
+    if (IS_PIPE(fd[1])) close(fd[1]);
+    fd[0] = 0, fd[1] = 1;
+    doom(s.pid_table[line]);
+    s.live_lines.erase(line);
+}
+
+void drop_user_pipe(int from, int to) {
+    session &r = np_sessions[to];
+    int(&fd)[2] = r.pipe_in[from];
+    if (IS_PIPE(fd[0])) close(fd[0]);
+    if (IS_PIPE(fd[1])) close(fd[1]);
+    fd[0] = 0, fd[1] = 1;
+    doom(r.pipe_pids[from]);
+    r.pipes_in &= ~(1u << from);
+    np_sessions[from].pipes_out &= ~(1u << to);
+}
+
+/* multicast user pipes (>N,M,... and >*)
+   The command writes into one pipe, and a relay process duplicates what
+   arrives there into every receiver's user pipe with tee(2), so the data
+   is not copied through user space. A receiver whose pipe is full gets
+   its share later from a buffer in the relay instead of holding up the
+   others, until it falls kRelayBacklog bytes behind; receivers that stop
+   reading are dropped. The relay only ends when every receiver has read
+   everything, so no receiver waits for it: it is reaped in the background
+   (np_detached). */
+const size_t kRelayChunk = 1 << 20, kRelayBacklog = 64 << 20;
+
+struct relay_out {
+    int fd;
+    string backlog;
+    size_t sent;
+};
+
+void relay(int in, const vector<int> &fds) {
+    const int null = open("/dev/null", O_WRONLY);
+    vector<relay_out> outs;
+    for (int fd : fds) {
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        outs.push_back(relay_out{fd, string(), 0});
+    }
+    string buf;
+    bool eof = false;
+    while (!outs.empty()) {
+        vector<struct pollfd> pfds;
+        size_t behind = 0;
+        for (const relay_out &o : outs) {
+            const size_t left = o.backlog.size() - o.sent;
+            pfds.push_back({o.fd, short(left > 0 ? POLLOUT : 0), 0});
+            behind = max(behind, left);
+        }
+        if (!eof && behind < kRelayBacklog) pfds.push_back({in, POLLIN, 0});
+        if (poll(&pfds[0], pfds.size(), -1) == -1) {
+            if (errno == EINTR) continue;
             break;
         }
+        // catch up from the backlogs
+        for (size_t i = 0; i < outs.size(); ++i) {
+            relay_out &o = outs[i];
+            if (pfds[i].revents == 0 || o.sent == o.backlog.size()) continue;
+            const ssize_t m =
+                write(o.fd, &o.backlog[o.sent], o.backlog.size() - o.sent);
+            if (m > 0) o.sent += m;
+            if (m == -1 && errno != EAGAIN) o.fd = -1;
+            if (o.sent == o.backlog.size()) o.backlog.clear(), o.sent = 0;
+        }
+        // new data: tee it to receivers caught up, buffer it for the rest
+        if (pfds.size() > outs.size() && pfds.back().revents) {
+            int avail = 0;
+            ioctl(in, FIONREAD, &avail);
+            const ssize_t n = min(size_t(avail), kRelayChunk);
+            if (n == 0) eof = true;
+            vector<ssize_t> got(outs.size(), n);
+            bool copy = false;
+            for (size_t i = 0; n > 0 && i < outs.size(); ++i) {
+                relay_out &o = outs[i];
+                if (o.fd == -1) continue;
+                got[i] = 0;
+                if (!o.backlog.empty()) {
+                    copy = true;
+                    continue;
+                }
+                got[i] = tee(in, o.fd, n, SPLICE_F_NONBLOCK);
+                if (got[i] == -1 && errno != EAGAIN) o.fd = -1, got[i] = n;
+                got[i] = max(got[i], ssize_t(0));
+                copy = copy || got[i] < n;
+            }
+            if (n > 0 && !copy) {
+                for (ssize_t left = n, m; left > 0; left -= m)
+                    if ((m = splice(in, nullptr, null, nullptr, left, 0)) <= 0)
+                        return;
+            } else if (n > 0) {
+                buf.resize(n);
+                for (ssize_t off = 0, m; off < n; off += m)
+                    if ((m = read(in, &buf[off], n - off)) <= 0) return;
+                for (size_t i = 0; i < outs.size(); ++i)
+                    if (got[i] < n)
+                        outs[i].backlog.append(buf, got[i], n - got[i]);
+            }
+        }
+        // drop receivers gone, and after EOF those that have it all
+        size_t kept = 0;
+        for (relay_out &o : outs) {
+            if (o.fd != -1 && eof && o.backlog.empty()) close(o.fd);
+            if (o.fd == -1 || (eof && o.backlog.empty())) continue;
+            swap(outs[kept++], o);
+        }
+        outs.resize(kept);
+    }
+}
+
+// start the relay for uid's multicast to upouts; the write end of its input
+int multicast(int uid, const vector<int> &upouts, deque<int> &pids) {
+    int fd[2];
+    while (pipe2(fd, O_CLOEXEC) == -1) mywait(pids);
+    vector<int> outs;
+    for (int to : upouts) outs.push_back(np_sessions[to].pipe_in[uid][1]);
+    int pid;
+    while ((pid = fork()) == -1) mywait(pids);
+    if (pid == 0) {
+        sigprocmask(SIG_SETMASK, &np_sigmask, nullptr);
+        setpgid(0, 0);
+        cg_enter();
+        // only what the relay uses stays open, or readers of other pipes
+        // (and the sender's client) would wait for it to exit to see EOF
+        set<int> keep(outs.begin(), outs.end());
+        keep.insert(fd[0]);
+        vector<int> open_fds;
+        if (DIR *dir = opendir("/proc/self/fd")) {
+            while (struct dirent *e = readdir(dir))
+                if (e->d_name[0] != '.') open_fds.push_back(atoi(e->d_name));
+            closedir(dir);
+        }
+        for (int f : open_fds)
+            if (keep.count(f) == 0) close(f);
+        relay(fd[0], outs);
+        _exit(0);
+    }
+    setpgid(pid, pid);
+    child_forked(pid);
+    np_detached.push_back(pid);
+    close(fd[0]);
+    // the relay holds the receivers' write ends now
+    for (int to : upouts) {
+        int &out = np_sessions[to].pipe_in[uid][1];
+        close(out);
+        out = 1;
     }
+    return fd[1];
+}
+
+// session i/o: unconsumed input, and output the io_uring backend has not
+// submitted (np_outbox) or not seen completed (np_sendbuf) yet
+bool np_uring = false;
+int np_current = -1;
+unsigned np_gen[30];
+// batch mode: one prompt per batch of queued lines
+bool np_batch[30];
+// the client shut down its side; what it sent is still run
+bool np_eof[30];
+string np_inbuf[30], np_outbox[30], np_sendbuf[30];
+int np_sending[30];
+/* dead peers and idle sessions
+   NP_KEEPALIVE (seconds) turns on TCP keepalive, NP_USER_TIMEOUT (ms) caps
+   how long sent data may stay unacknowledged, and NP_IDLE_TIMEOUT
+   (seconds) logs out a user who sends nothing for that long. np_active is
+   when a user last sent anything (tr_now()). */
+int np_keepalive = 0, np_user_timeout = 0;
+uint64_t np_idle_ns = 0;
+uint64_t np_active[30];
+
+/* per-session cgroups (cgroup v2)
+   NP_CGROUP_ROOT names a cgroup directory delegated to the server (not the
+   one it runs in). Each session gets a group np-<server pid>-<uid> there
+   that its commands join between fork and exec, limited by
+   NP_CGROUP_CPU_WEIGHT, NP_CGROUP_MEMORY_MAX and NP_CGROUP_PIDS_MAX. The
+   group's cpu and memory usage is logged when the user leaves. Anything
+   the kernel refuses (no delegation, controller missing) just leaves the
+   commands where the server is. */
+string np_cg_root;
+struct cg_limit {
+    const char *file, *env;
+    const char *value;
+} np_cg_limits[] = {{"cpu.weight", "NP_CGROUP_CPU_WEIGHT", nullptr},
+                    {"memory.max", "NP_CGROUP_MEMORY_MAX", nullptr},
+                    {"pids.max", "NP_CGROUP_PIDS_MAX", nullptr}};
+// each session's cgroup.procs, or -1
+int np_cg_procs[30];
+
+bool cg_write(const string &path, const string &value) {
+    const int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+    const bool ok =
+        write(fd, value.data(), value.size()) == ssize_t(value.size());
+    close(fd);
+    return ok;
+}
+
+void cg_init() {
+    for (int &fd : np_cg_procs) fd = -1;
+    const char *root = getenv("NP_CGROUP_ROOT");
+    if (root == nullptr || *root == '\0') return;
+    np_cg_root = root;
+    for (cg_limit &limit : np_cg_limits) limit.value = getenv(limit.env);
+    // one at a time: a controller the root lacks must not block the others
+    for (const char *ctl : {"+cpu", "+memory", "+pids"})
+        cg_write(np_cg_root + "/cgroup.subtree_control", ctl);
+}
+
+string cg_path(int uid) {
+    return np_cg_root + "/np-" + to_string(getpid()) + "-" + to_string(uid);
+}
+
+void cg_open(int uid) {
+    if (np_cg_root.empty()) return;
+    // a group left busy by a previous session in the slot is reused
+    const string dir = cg_path(uid);
+    if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST) return;
+    for (const cg_limit &limit : np_cg_limits) {
+        if (limit.value != nullptr)
+            cg_write(dir + "/" + limit.file, limit.value);
+    }
+    np_cg_procs[uid] = open((dir + "/cgroup.procs").c_str(),
+                            O_WRONLY | O_CLOEXEC);
+}
+
+// first number after key in a cgroup file ("" for a single value), or -1
+long long cg_read(const string &path, const string &key) {
+    ifstream in(path);
+    string word;
+    long long value;
+    if (key.empty()) return in >> value ? value : -1;
+    while (in >> word)
+        if (word == key) return in >> value ? value : -1;
+    return -1;
+}
+
+void cg_close(int uid) {
+    if (np_cg_procs[uid] == -1) return;
+    close(np_cg_procs[uid]);
+    np_cg_procs[uid] = -1;
+    const string dir = cg_path(uid);
+    ostringstream os;
+    os << "session usage: uid " << uid << " cpu "
+       << cg_read(dir + "/cpu.stat", "usage_usec") / 1000 << " ms";
+    const long long peak = cg_read(dir + "/memory.peak", "");
+    if (peak != -1) os << " memory peak " << peak / 1024 << " KiB";
+    os << '\n';
+    const string msg = os.str();
+    write(tr_log_fd, msg.c_str(), msg.size());
+    // busy while commands left in the background still run
+    rmdir(dir.c_str());
+}
+
+// in a forked command: join the group of the session running it
+void cg_enter() {
+    const int uid = np_current;
+    if (uid != -1 && np_cg_procs[uid] != -1) write(np_cg_procs[uid], "0", 1);
+}
+
+int initialize(int csock) {
+    if (np_free == 0) return -1;
+    const int uid = __builtin_ctz(np_free);
+    np_free &= ~(1u << uid);
+    np_user[uid] = csock;
     // info
     np_name[uid] = "(no name)";
+    np_batch[uid] = false;
     // shell
     np_env[uid]["PATH"] = "bin:.";
-    np_line[uid] = 1;
-    for (int(&fd)[2] : np_fd_table[uid]) fd[0] = 0, fd[1] = 1;
-    for (int(&fd)[2] : np_user_pipe[uid]) fd[0] = 0, fd[1] = 1;
+    cg_open(uid);
     return uid;
 }
 
 void terminate(int uid) {
+    cg_close(uid);
     np_user[uid] = -1;
     np_name[uid] = "(no name)";
     np_env[uid].clear();
-    // TODO: wait or kill
-    for (size_t i = 0; i < 2000; ++i) np_pid_table[uid][i].clear();
-    for (int(&user_pipe)[30][2] : np_user_pipe) {
-        int(&fd)[2] = user_pipe[uid];
-        close(fd[0]);
-        close(fd[1]);
-        fd[0] = 0, fd[1] = 1;
-    }
-    for (int(&fd)[2] : np_user_pipe[uid]) {
-        close(fd[0]);
-        close(fd[1]);
-        fd[0] = 0, fd[1] = 1;
+    // numbered pipes still waiting for their line, and user pipes both ways
+    session &s = np_sessions[uid];
+    while (!s.live_lines.empty()) drop_line(s, *s.live_lines.begin());
+    while (s.pipes_in) drop_user_pipe(__builtin_ctz(s.pipes_in), uid);
+    while (s.pipes_out) drop_user_pipe(uid, __builtin_ctz(s.pipes_out));
+    s.line = 1;
+    np_free |= 1u << uid;
+}
+
+void send_to(int uid, const string &msg) {
+    // queue for the next submission, unless the user's own command is
+    // running and writing to the socket directly
+    if (np_uring && uid != np_current) {
+        np_outbox[uid] += msg;
+        return;
     }
-    // TODO: wait or kill
-    for (deque<int>(&up_pid)[30] : np_up_pid) up_pid[uid].clear();
-    for (deque<int> &up_pid : np_up_pid[uid]) up_pid.clear();
+    write(np_user[uid], msg.c_str(), msg.size());
 }
 
 void broadcast(string msg) {
-    const char *cmsg = msg.c_str();
-    size_t clen = msg.size();
-    for (int sock : np_user) {
-        if (sock != -1) {
-            write(sock, cmsg, clen);
+    const uint64_t t = tr_now();
+    for (int i = 0; i < 30; ++i) {
+        if (np_user[i] != -1) {
+            send_to(i, msg);
+        }
+    }
+    tr_record(TR_WRITE, t);
+}
+
+/* builtins
+   A builtin is one np_builtins entry: its name, how many words it takes
+   (missing ones are empty) and its handler, which also gets the rest of
+   the line and returns -1 to end the session. Lookup is a perfect hash
+   found at compile time: kBiSeed is the first seed that gives every name
+   its own slot in bi_table, so any command word costs one hash and at most
+   one compare. */
+typedef int (*builtin_fn)(int uid, const vector<string> &args, istream &rest);
+struct builtin {
+    const char *name;
+    int arity;
+    builtin_fn run;
+};
+
+int bi_setenv(int uid, const vector<string> &args, istream &rest) {
+    // synopsis: setenv [environment variable] [value to assign]
+    np_env[uid][args[0]] = args[1];
+    setenv(args[0].c_str(), args[1].c_str(), 1);
+    return 0;
+}
+
+int bi_printenv(int uid, const vector<string> &args, istream &rest) {
+    // synopsis: printenv [environment variable]
+    char *env = getenv(args[0].c_str());
+    if (env != nullptr) cout << env << endl;
+    return 0;
+}
+
+int bi_exit(int uid, const vector<string> &args, istream &rest) {
+    // synopsis: exit
+    return -1;
+}
+
+int bi_batch(int uid, const vector<string> &args, istream &rest) {
+    // synopsis: batch [on|off]
+    if (args[0] == "on" || args[0] == "off") np_batch[uid] = args[0] == "on";
+    return 0;
+}
+
+int bi_name(int uid, const vector<string> &args, istream &rest) {
+    // synopsis: name [new username]
+    const string &arg = args[0];
+    bool found = false;
+    for (const string &name : np_name) {
+        if (name == arg) {
+            found = true;
+            break;
+        }
+    }
+    if (found) {
+        cout << "*** User '" << arg << "' already exists. ***" << endl;
+    } else {
+        np_name[uid] = arg;
+        string msg = "*** User from " + np_address[uid] + " is named '" +
+                     arg + "'. ***\n";
+        broadcast(msg);
+    }
+    return 0;
+}
+
+int bi_who(int uid, const vector<string> &args, istream &rest) {
+    // synopsis: who
+    cout << "<ID>\t<nickname>\t<IP/port>\t<indicate me>" << endl;
+    for (int i = 0; i < 30; ++i) {
+        if (np_user[i] != -1) {
+            cout << i + 1 << '\t' << np_name[i] << '\t' << np_address[i];
+            if (i == uid) cout << "\t<-me";
+            cout << endl;
+        }
+    }
+    return 0;
+}
+
+int bi_tell(int uid, const vector<string> &args, istream &rest) {
+    // synopsis: tell [user id] [message]
+    const int tuid = atoi(args[0].c_str()) - 1;
+    string arg;
+    ws(rest);
+    getline(rest, arg);
+    if (tuid < 0 || tuid >= 30 || np_user[tuid] == -1) {
+        cout << "*** Error: user #" << (tuid + 1) << " does not exist yet. ***"
+             << endl;
+    } else {
+        string msg = "*** " + np_name[uid] + " told you ***: " + arg + "\n";
+        const uint64_t t = tr_now();
+        send_to(tuid, msg);
+        tr_record(TR_WRITE, t);
+    }
+    return 0;
+}
+
+int bi_yell(int uid, const vector<string> &args, istream &rest) {
+    // synopsis: yell [message]
+    string arg;
+    ws(rest);
+    getline(rest, arg);
+    string msg = "*** " + np_name[uid] + " yelled ***: " + arg + "\n";
+    broadcast(msg);
+    return 0;
+}
+
+constexpr builtin np_builtins[] = {
+    {"setenv", 2, &bi_setenv}, {"printenv", 1, &bi_printenv},
+    {"exit", 0, &bi_exit},     {"batch", 1, &bi_batch},
+    {"name", 1, &bi_name},     {"who", 0, &bi_who},
+    {"tell", 1, &bi_tell},     {"yell", 0, &bi_yell},
+};
+constexpr size_t kBuiltins = sizeof(np_builtins) / sizeof(np_builtins[0]);
+// slots: a power of two, at least four per builtin
+constexpr unsigned bi_bits(unsigned b) {
+    return (1u << b) >= 4 * kBuiltins ? b : bi_bits(b + 1);
+}
+constexpr unsigned kBiBits = bi_bits(1), kBiSlots = 1u << kBiBits;
+
+// seeded FNV-1a; the constexpr form builds the table, the other looks up.
+// Slots come from the top bits, the only ones that depend on every byte.
+constexpr uint32_t bi_hash(const char *s, uint32_t h) {
+    return *s == '\0' ? h : bi_hash(s + 1, (h ^ uint8_t(*s)) * 16777619u);
+}
+uint32_t bi_hash(const string &s, uint32_t h) {
+    for (char c : s) h = (h ^ uint8_t(c)) * 16777619u;
+    return h;
+}
+constexpr unsigned bi_slot(size_t i, uint32_t seed) {
+    return bi_hash(np_builtins[i].name, seed) >> (32 - kBiBits);
+}
+// whether builtins i and j or any pair after them share a slot
+constexpr bool bi_collide(uint32_t seed, size_t i, size_t j) {
+    return i + 1 >= kBuiltins ? false
+           : j == kBuiltins   ? bi_collide(seed, i + 1, i + 2)
+                              : bi_slot(i, seed) == bi_slot(j, seed) ||
+                                  bi_collide(seed, i, j + 1);
+}
+// first collision-free seed in [lo, lo + n), or 0; halving keeps the
+// recursion shallow
+constexpr uint32_t bi_search(uint32_t lo, uint32_t n);
+constexpr uint32_t bi_or_search(uint32_t seed, uint32_t lo, uint32_t n) {
+    return seed != 0 ? seed : bi_search(lo, n);
+}
+constexpr uint32_t bi_search(uint32_t lo, uint32_t n) {
+    return n == 1 ? (bi_collide(lo, 0, 1) ? 0 : lo)
+                  : bi_or_search(bi_search(lo, n / 2), lo + n / 2, n - n / 2);
+}
+constexpr uint32_t kBiSeed = bi_search(1, 1 << 16);
+static_assert(kBiSeed != 0, "no perfect hash seed for np_builtins");
+// index of the builtin in slot s, or -1
+constexpr int bi_entry(unsigned s, size_t i) {
+    return i == kBuiltins                 ? -1
+           : bi_slot(i, kBiSeed) == s ? int(i)
+                                          : bi_entry(s, i + 1);
+}
+template <unsigned... I>
+struct bi_seq {};
+template <unsigned N, unsigned... I>
+struct bi_make_seq : bi_make_seq<N - 1, N - 1, I...> {};
+template <unsigned... I>
+struct bi_make_seq<0, I...> {
+    typedef bi_seq<I...> type;
+};
+struct bi_slots {
+    int8_t index[kBiSlots];
+};
+template <unsigned... I>
+constexpr bi_slots bi_make_table(bi_seq<I...>) {
+    return {{int8_t(bi_entry(I, 0))...}};
+}
+constexpr bi_slots bi_table = bi_make_table(bi_make_seq<kBiSlots>::type());
+
+const builtin *find_builtin(const string &cmd) {
+    const int i = bi_table.index[bi_hash(cmd, kBiSeed) >> (32 - kBiBits)];
+    return i >= 0 && cmd == np_builtins[i].name ? &np_builtins[i] : nullptr;
+}
+
+/* output cache
+   Commands listed in the NP_CACHE_CONFIG file (one name per line, '#'
+   comments) are declared pure: same arguments, files and environment,
+   same output. A line made only of them, printing to the user, with no
+   numbered or user pipe in and a regular file argument to its first
+   command (so nothing reads the socket) is keyed by its parsed pipeline,
+   the (device, inode, mtime, size) of every binary and file argument, and
+   the user's environment. A miss runs it into a memfd; an output with
+   nothing on stderr is kept, least recently used first out, within
+   NP_CACHE_MAX bytes (default 16 MiB). A hit is sent with sendfile()
+   without forking. */
+struct cache_entry {
+    int fd;
+    size_t size;
+    string key;
+};
+unordered_set<string> np_pure;
+size_t np_cache_max = 16 << 20, np_cache_size = 0;
+const size_t kCacheEntries = 64;
+list<cache_entry> np_cache;
+unordered_map<string, list<cache_entry>::iterator> np_cache_index;
+
+void cache_init() {
+    const char *config = getenv("NP_CACHE_CONFIG");
+    if (config == nullptr) return;
+    ifstream in(config);
+    string line, name;
+    while (getline(in, line)) {
+        stringstream ss(line);
+        if (ss >> name && name[0] != '#') np_pure.insert(name);
+    }
+    const char *max = getenv("NP_CACHE_MAX");
+    if (max != nullptr) np_cache_max = strtoull(max, nullptr, 10);
+}
+
+void put_stamp(string &key, const struct stat &st) {
+    const uint64_t stamp[] = {uint64_t(st.st_dev), uint64_t(st.st_ino),
+                              uint64_t(st.st_mtim.tv_sec),
+                              uint64_t(st.st_mtim.tv_nsec),
+                              uint64_t(st.st_size)};
+    key.append((const char *)stamp, sizeof(stamp));
+}
+
+// the file execvp() would run, from the user's PATH
+bool find_exe(int uid, const string &name, struct stat &st) {
+    if (name.find('/') != string::npos)
+        return stat(name.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+    const auto it = np_env[uid].find("PATH");
+    stringstream path(it != np_env[uid].end() ? it->second : "");
+    string dir;
+    while (getline(path, dir, ':')) {
+        const string exe = (dir.empty() ? "." : dir) + "/" + name;
+        if (stat(exe.c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+            access(exe.c_str(), X_OK) == 0)
+            return true;
+    }
+    return false;
+}
+
+// false when the pipeline cannot be cached
+bool cache_key(int uid, const vector<vector<string>> &args, string &key) {
+    if (np_pure.empty()) return false;
+    key.clear();
+    bool reads_file = false;
+    struct stat st;
+    for (size_t i = 0; i < args.size(); ++i) {
+        const vector<string> &argv = args[i];
+        if (np_pure.count(argv[0]) == 0 || !find_exe(uid, argv[0], st))
+            return false;
+        put_stamp(key, st);
+        for (const string &arg : argv) {
+            key.append(arg.c_str(), arg.size() + 1);
+            if (&arg == &argv[0] || stat(arg.c_str(), &st) != 0 ||
+                !S_ISREG(st.st_mode))
+                continue;
+            put_stamp(key, st);
+            if (i == 0) reads_file = true;
         }
+        key += '|';
+    }
+    for (const pair<const string, string> &var : np_env[uid])
+        key += var.first + '=' + var.second + '\0';
+    return reads_file;
+}
+
+void send_file(int sock, int fd, size_t size) {
+    off_t off = 0;
+    while (size_t(off) < size) {
+        if (sendfile(sock, fd, &off, size - off) <= 0 && errno != EINTR)
+            break;
     }
 }
 
-int npshell(const int uid) {
+// send a cached output; false on a miss
+bool cache_hit(const string &key, int sock) {
+    auto it = np_cache_index.find(key);
+    if (it == np_cache_index.end()) return false;
+    np_cache.splice(np_cache.begin(), np_cache, it->second);
+    send_file(sock, it->second->fd, it->second->size);
+    return true;
+}
+
+// send what a miss wrote to its memfds, keeping a clean stdout
+void cache_store(const string &key, int out, int err, int sock) {
+    const size_t out_size = lseek(out, 0, SEEK_END),
+                 err_size = lseek(err, 0, SEEK_END);
+    send_file(sock, out, out_size);
+    send_file(sock, err, err_size);
+    close(err);
+    if (err_size != 0 || out_size > np_cache_max ||
+        np_cache_index.count(key) != 0) {
+        close(out);
+        return;
+    }
+    np_cache.push_front({out, out_size, key});
+    np_cache_index[key] = np_cache.begin();
+    np_cache_size += out_size;
+    while (np_cache_size > np_cache_max || np_cache.size() > kCacheEntries) {
+        const cache_entry &old = np_cache.back();
+        np_cache_size -= old.size;
+        close(old.fd);
+        np_cache_index.erase(old.key);
+        np_cache.pop_back();
+    }
+}
+
+/* parsed pipelines
+   A line that is not a builtin is tokenized once and kept by its text,
+   least recently used first out, so running it again skips the
+   stringstream work. The parse depends on the text alone (who >* reaches
+   is looked up each run). argv arrays are built in the forked child,
+   which costs the server nothing. */
+struct pipeline {
+    // see npshell() for mode; file for mode 0, upouts (1-based) for 8
+    int mode, np, upin;
+    string file;
+    vector<int> upouts;
+    bool up_all;
+    vector<vector<string>> args;
+};
+const size_t kParseEntries = 256;
+list<pair<string, pipeline>> np_parsed;
+unordered_map<string, list<pair<string, pipeline>>::iterator> np_parsed_index;
+
+// the parse of line, valid until the next call
+const pipeline &parse_pipeline(const string &line) {
+    auto it = np_parsed_index.find(line);
+    if (it != np_parsed_index.end()) {
+        np_parsed.splice(np_parsed.begin(), np_parsed, it->second);
+        return it->second->second;
+    }
+    pipeline p;
+    p.mode = 10, p.np = -1, p.upin = -1, p.up_all = false;
+    stringstream ss(line);
+    string cmd, arg;
+    ss >> cmd;
+    // parse all commands and arguments
+    bool has_next = true;
+    while (has_next) {
+        has_next = false;
+        vector<string> argv = {cmd};
+        while (ss >> arg) {
+            if (arg == ">") {
+                p.mode = 0;
+                ss >> p.file;
+                break;
+            } else if (arg[0] == '>') {
+                // >N, or a multicast to >N,M,... or to everyone else (>*)
+                p.mode = 8;
+                p.upouts.clear();
+                p.up_all = arg == ">*";
+                stringstream list(arg.substr(1, arg.size() - 1));
+                string to;
+                while (!p.up_all && getline(list, to, ','))
+                    p.upouts.push_back(stoi(to));
+                continue;
+            } else if (arg[0] == '<') {
+                p.upin = stoi(arg.substr(1, arg.size() - 1));
+                assert(p.upin >= 0);
+                continue;
+            } else if (arg == "|") {
+                has_next = true;
+                ss >> cmd;
+                break;
+            } else if (arg[0] == '|' || arg[0] == '!') {
+                p.np = stoi(arg.substr(1, arg.size() - 1));
+                assert(p.np > 0);
+                p.mode = 20 + (arg[0] == '!' ? 1 : 0);
+                break;
+            }
+            argv.push_back(arg);
+        }
+        p.args.emplace_back(argv);
+    }
+    np_parsed.emplace_front(line, std::move(p));
+    np_parsed_index[line] = np_parsed.begin();
+    if (np_parsed.size() > kParseEntries) {
+        np_parsed_index.erase(np_parsed.back().first);
+        np_parsed.pop_back();
+    }
+    return np_parsed.front().second;
+}
+
+int npshell(const int uid, string cmd) {
     const int sock = np_user[uid];
     for (size_t i = 0; i < 3; ++i) dup2(sock, i);
     // default environment variables
@@ -159,85 +1162,22 @@ int npshell(const int uid) {
     for (const pair<string, string> var : np_env[uid])
         setenv(var.first.c_str(), var.second.c_str(), 1);
     // numbered pipe
-    int &line = np_line[uid];
-    int(&fd_table)[2000][2] = np_fd_table[uid];
-    deque<int>(&pid_table)[2000] = np_pid_table[uid];
-    string cmd, arg;
-    // EOF
-    if (!getline(cin, cmd)) {
-        cout << endl;
-        return -1;
-    }
-    if (!cmd.empty() && cmd[cmd.length() - 1] == '\n')
-        cmd.erase(cmd.length() - 1);
+    session &s = np_sessions[uid];
+    int &line = s.line;
+    int(&fd_table)[2000][2] = s.fd_table;
+    deque<int>(&pid_table)[2000] = s.pid_table;
     if (!cmd.empty() && cmd[cmd.length() - 1] == '\r')
         cmd.erase(cmd.length() - 1);
     const string full_cmd = cmd;
     stringstream ss(cmd);
     ss >> cmd;
     if (cmd.empty()) return 0;
+    tr_begin(uid, full_cmd);
     line = (line + 1) % 2000;
-    if (cmd == "setenv") {
-        // synopsis: setenv [environment variable] [value to assign]
-        ss >> cmd >> arg;
-        np_env[uid][cmd] = arg;
-        setenv(cmd.c_str(), arg.c_str(), 1);
-    } else if (cmd == "printenv") {
-        // synopsis: printenv [environment variable]
-        ss >> arg;
-        char *env = getenv(arg.c_str());
-        if (env != nullptr) cout << env << endl;
-    } else if (cmd == "exit") {
-        // synopsis: exit
-        return -1;
-    } else if (cmd == "name") {
-        // synopsis: name [new username]
-        ss >> arg;
-        bool found = false;
-        for (const string &name : np_name) {
-            if (name == arg) {
-                found = true;
-                break;
-            }
-        }
-        if (found) {
-            cout << "*** User '" << arg << "' already exists. ***" << endl;
-        } else {
-            np_name[uid] = arg;
-            string msg = "*** User from " + np_address[uid] + " is named '" +
-                         arg + "'. ***\n";
-            broadcast(msg);
-        }
-    } else if (cmd == "who") {
-        // synopsis: who
-        cout << "<ID>\t<nickname>\t<IP/port>\t<indicate me>" << endl;
-        for (int i = 0; i < 30; ++i) {
-            if (np_user[i] != -1) {
-                cout << i + 1 << '\t' << np_name[i] << '\t' << np_address[i];
-                if (i == uid) cout << "\t<-me";
-                cout << endl;
-            }
-        }
-    } else if (cmd == "tell") {
-        // synopsis: tell [user id] [message]
-        int tuid;
-        ss >> tuid;
-        --tuid;
-        ws(ss);
-        getline(ss, arg);
-        if (np_user[tuid] == -1) {
-            cout << "*** Error: user #" << (tuid + 1)
-                 << " does not exist yet. ***" << endl;
-        } else {
-            string msg = "*** " + np_name[uid] + " told you ***: " + arg + "\n";
-            write(np_user[tuid], msg.c_str(), msg.size());
-        }
-    } else if (cmd == "yell") {
-        // synopsis: yell [message]
-        ws(ss);
-        getline(ss, arg);
-        string msg = "*** " + np_name[uid] + " yelled ***: " + arg + "\n";
-        broadcast(msg);
+    if (const builtin *bi = find_builtin(cmd)) {
+        vector<string> args(bi->arity);
+        for (string &a : args) ss >> a;
+        if (bi->run(uid, args, ss) == -1) return -1;
     } else {
         /* mode
          0: stdout to overwrite file
@@ -246,46 +1186,35 @@ int npshell(const int uid) {
          20: stdout numbered pipe
          21: stdout stderr numbered pipe
         */
-        int mode = 10, np = -1, upin = -1, upout = -1;
-        // parse all commands and arguments
-        vector<vector<string>> args;
-        bool has_next = true;
-        while (has_next) {
-            has_next = false;
-            vector<string> argv = {cmd};
-            while (ss >> arg) {
-                if (arg == ">") {
-                    mode = 0;
-                    ss >> cmd;
-                    break;
-                } else if (arg[0] == '>') {
-                    mode = 8;
-                    upout = stoi(arg.substr(1, arg.size() - 1));
-                    assert(upout >= 0);
-                    continue;
-                } else if (arg[0] == '<') {
-                    upin = stoi(arg.substr(1, arg.size() - 1));
-                    assert(upin >= 0);
-                    continue;
-                } else if (arg == "|") {
-                    has_next = true;
-                    ss >> cmd;
-                    break;
-                } else if (arg[0] == '|' || arg[0] == '!') {
-                    np = stoi(arg.substr(1, arg.size() - 1));
-                    assert(np > 0);
-                    mode = 20 + (arg[0] == '!' ? 1 : 0);
-                    break;
-                }
-                argv.push_back(arg);
-            }
-            args.emplace_back(argv);
+        const pipeline &p = parse_pipeline(full_cmd);
+        const vector<vector<string>> &args = p.args;
+        int mode = p.mode, np = p.np, upin = p.upin;
+        vector<int> upouts = p.upouts;
+        if (p.up_all) {
+            for (int to = 0; to < 30; ++to)
+                if (np_user[to] != -1 && to != uid) upouts.push_back(to + 1);
         }
+        tr_record(TR_PARSE, tr_start);
         // enqueue previous pid
-        int nline = (line + np) % 2000;
+        int nline = (line + np + 2000) % 2000;
         pid_table[nline].insert(pid_table[nline].begin(),
                                 pid_table[line].begin(), pid_table[line].end());
         pid_table[line].clear();
+        if (!pid_table[nline].empty()) s.live_lines.insert(nline);
+        // output cache: a hit replaces the run, a miss runs into memfds
+        string key;
+        int cache_out = -1, cache_err = -1;
+        if (mode == 10 && upin == -1 &&
+            !IS_PIPE(fd_table[line][0]) && cache_key(uid, args, key)) {
+            if (cache_hit(key, sock)) return 0;
+            cache_out = memfd_create("np_cache", MFD_CLOEXEC);
+            cache_err = memfd_create("np_cache", MFD_CLOEXEC);
+            if (cache_out == -1 || cache_err == -1) {
+                if (cache_out != -1) close(cache_out);
+                if (cache_err != -1) close(cache_err);
+                cache_out = cache_err = -1;
+            }
+        }
         // prepare fd
         if (upin != -1) {
             --upin;
@@ -293,7 +1222,7 @@ int npshell(const int uid) {
                 cout << "*** Error: user #" << (upin + 1)
                      << " does not exist yet. ***" << endl;
                 return 0;
-            } else if (!IS_PIPE(np_user_pipe[upin][uid][0])) {
+            } else if (!IS_PIPE(s.pipe_in[upin][0])) {
                 cout << "*** Error: the pipe #" << (upin + 1) << "->#"
                      << (uid + 1) << " does not exist yet. ***" << endl;
                 return 0;
@@ -303,160 +1232,1034 @@ int npshell(const int uid) {
                              np_name[upin] + " (#" + to_string(upin + 1) +
                              ") by '" + full_cmd + "' ***\n";
                 broadcast(msg);
-                // user pipe
+                // user pipe: its read end and writers become this line's
                 pid_table[nline].insert(pid_table[nline].begin(),
-                                        np_up_pid[upin][uid].begin(),
-                                        np_up_pid[upin][uid].end());
-                np_up_pid[upin][uid].clear();
-                close(np_user_pipe[upin][uid][1]);
-                fd_table[line][0] = np_user_pipe[upin][uid][0];
+                                        s.pipe_pids[upin].begin(),
+                                        s.pipe_pids[upin].end());
+                s.pipe_pids[upin].clear();
+                if (!pid_table[nline].empty()) s.live_lines.insert(nline);
+                fd_table[line][0] = s.pipe_in[upin][0];
+                s.live_lines.insert(line);
+                s.pipe_in[upin][0] = 0;
+                drop_user_pipe(upin, uid);
             }
         }
-        if (upout != -1) {
-            --upout;
-            if (upout >= 30 || np_user[upout] == -1) {
-                cout << "*** Error: user #" << (upout + 1)
-                     << " does not exist yet. ***" << endl;
+        if (mode == 8) {
+            if (upouts.empty()) {
+                cout << "*** Error: no other user is online. ***" << endl;
                 return 0;
-            } else if (IS_PIPE(np_user_pipe[uid][upout][0])) {
-                cout << "*** Error: the pipe #" << (uid + 1) << "->#"
-                     << (upout + 1) << " already exists. ***" << endl;
-                return 0;
-            } else {
+            }
+            sort(upouts.begin(), upouts.end());
+            upouts.erase(unique(upouts.begin(), upouts.end()), upouts.end());
+            for (int &upout : upouts) {
+                --upout;
+                if (upout < 0 || upout >= 30 || np_user[upout] == -1) {
+                    cout << "*** Error: user #" << (upout + 1)
+                         << " does not exist yet. ***" << endl;
+                    return 0;
+                } else if (IS_PIPE(np_sessions[upout].pipe_in[uid][0])) {
+                    cout << "*** Error: the pipe #" << (uid + 1) << "->#"
+                         << (upout + 1) << " already exists. ***" << endl;
+                    return 0;
+                }
+            }
+            for (int upout : upouts) {
                 string msg = "*** " + np_name[uid] + " (#" +
                              to_string(uid + 1) + ") just piped '" + full_cmd +
                              "' to " + np_name[upout] + " (#" +
                              to_string(upout + 1) + ") ***\n";
                 broadcast(msg);
-                // pid
-                np_up_pid[uid][upout].insert(np_up_pid[uid][upout].begin(),
-                                             pid_table[nline].begin(),
-                                             pid_table[nline].end());
-                pid_table[nline].clear();
-                // open user pipe
-                while (pipe(np_user_pipe[uid][upout]) == -1)
+            }
+            // pid: the first receiver waits for the writers
+            session &r = np_sessions[upouts[0]];
+            r.pipe_pids[uid].insert(r.pipe_pids[uid].begin(),
+                                    pid_table[nline].begin(),
+                                    pid_table[nline].end());
+            pid_table[nline].clear();
+            // open user pipes
+            for (int upout : upouts) {
+                session &r = np_sessions[upout];
+                while (pipe2(r.pipe_in[uid], O_CLOEXEC) == -1)
                     mywait(pid_table[nline]);
-                fd_table[nline][1] = np_user_pipe[uid][upout][1];
+                r.pipes_in |= 1u << uid;
+                s.pipes_out |= 1u << upout;
             }
+            fd_table[nline][1] = upouts.size() == 1
+                                     ? r.pipe_in[uid][1]
+                                     : multicast(uid, upouts, r.pipe_pids[uid]);
         }
-        deque<int> &pidout =
-            (mode == 8) ? np_up_pid[uid][upout] : pid_table[nline];
+        deque<int> &pidout = (mode == 8)
+                                 ? np_sessions[upouts[0]].pipe_pids[uid]
+                                 : pid_table[nline];
         if (mode == 0) {
             // 0: open file
             fd_table[nline][1] =
-                open(cmd.c_str(), O_WRONLY | O_CREAT | O_TRUNC, file_perm);
+                open(p.file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                     file_perm);
         } else if (mode == 20 || mode == 21) {
             // 20, 21: open numbered pipe
             if (!IS_PIPE(fd_table[nline][0])) {
-                while (pipe(fd_table[nline]) == -1) mywait(pid_table[nline]);
+                while (pipe2(fd_table[nline], O_CLOEXEC) == -1)
+                    mywait(pid_table[nline]);
             }
         }
         // execute commands
         if (IS_PIPE(fd_table[line][1])) close(fd_table[line][1]);
-        exec(args, pidout, fd_table[line][0], fd_table[nline][1], mode);
+        if (cache_out != -1) dup2(cache_err, 2);
+        exec(args, pidout, fd_table[line][0],
+             cache_out != -1 ? cache_out : fd_table[nline][1], mode);
+        if (mode != 8 && !pidout.empty()) s.live_lines.insert(nline);
         if (IS_PIPE(fd_table[line][0])) close(fd_table[line][0]);
-        if (upin != -1) {
-            close(np_user_pipe[upin][uid][0]);
-            np_user_pipe[upin][uid][0] = 0;
-            np_user_pipe[upin][uid][0] = 1;
+        if (mode == 8) {
+            // only the writers keep the user pipe's write end
+            close(fd_table[nline][1]);
+            if (upouts.size() == 1) np_sessions[upouts[0]].pipe_in[uid][1] = 1;
+            fd_table[nline][1] = 1;
         }
-        // wait for current line
+        // wait for current line, then free its output (the file of mode 0)
         if (mode < 20) {
-            for (int p : pid_table[nline]) waitpid(p, nullptr, 0);
+            const uint64_t t = tr_now();
+            for (int p : pid_table[nline]) wait_child(p);
+            tr_record(TR_WAIT, t);
+            pid_table[nline].clear();
+            drop_line(s, nline);
+        }
+        if (cache_out != -1) {
+            dup2(sock, 2);
+            cache_store(key, cache_out, cache_err, sock);
         }
         // cleanup current line
         fd_table[line][0] = 0;
         fd_table[line][1] = 1;
+        s.live_lines.erase(line);
     }
     return 0;
 }
 
-int main(int argc, char **argv) {
-    // server socket
-    int ssock = socket(AF_INET, SOCK_STREAM, 0);
-    int on = 1;
-    setsockopt(ssock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
-    setsockopt(ssock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
-    struct sockaddr_in saddr, caddr;
-    saddr.sin_family = AF_INET;
-    saddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    if (argc > 1) {
-        uint16_t port;
-        stringstream ss(argv[1]);
-        ss >> port;
-        saddr.sin_port = htons(port);
-    } else {
-        saddr.sin_port = htons(5566);
+const char welcome[] =
+    "****************************************\n"
+    "** Welcome to the information server. **\n"
+    "****************************************\n";
+
+void uring_recv(int uid);
+void uring_drain(int uid);
+
+/* optional AF_UNIX listener next to the TCP one
+   NP_UNIX_PATH: socket path; a stale socket left there is replaced
+   NP_UNIX_MODE: its permissions in octal (default 0666) */
+int unix_listener(int backlog) {
+    const char *path = getenv("NP_UNIX_PATH");
+    if (path == nullptr || *path == '\0') return -1;
+    struct sockaddr_un uaddr;
+    memset(&uaddr, 0, sizeof(uaddr));
+    uaddr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(uaddr.sun_path)) {
+        cerr << "NP_UNIX_PATH too long: " << path << endl;
+        return -1;
     }
-    bind(ssock, (struct sockaddr *)&saddr, sizeof(saddr));
-    listen(ssock, 30);
-    // client socket
-    int csock;
-    socklen_t clen = sizeof(caddr);
+    strcpy(uaddr.sun_path, path);
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+    int usock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (bind(usock, (struct sockaddr *)&uaddr, sizeof(uaddr)) == -1) {
+        cerr << "bind " << path << ": " << strerror(errno) << endl;
+        close(usock);
+        return -1;
+    }
+    const char *mode = getenv("NP_UNIX_MODE");
+    chmod(path, mode != nullptr ? strtol(mode, nullptr, 8) : 0666);
+    listen(usock, backlog);
+    return usock;
+}
+
+// "ip/port" for TCP peers, "unix/<uid>/<pid>" from SO_PEERCRED for local
+// ones
+string peer_address(int csock) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (getpeername(csock, (struct sockaddr *)&addr, &len) == -1) return "?";
+    if (addr.ss_family == AF_UNIX) {
+        struct ucred cred;
+        len = sizeof(cred);
+        if (getsockopt(csock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+            return "unix/?";
+        return "unix/" + to_string(cred.uid) + "/" + to_string(cred.pid);
+    }
+    const struct sockaddr_in &caddr = *(struct sockaddr_in *)&addr;
     char cip[INET_ADDRSTRLEN];
-    int nfds = getdtablesize();
-    fd_set rfds, afds;
-    FD_ZERO(&afds);
-    FD_SET(ssock, &afds);
-    // initialize
-    for (size_t i = 0; i < 3; ++i) stdfd[i] = dup(i);
-    for (int &sock : np_user) sock = -1;
+    inet_ntop(AF_INET, &caddr.sin_addr, cip, INET_ADDRSTRLEN);
+    return string(cip) + "/" + to_string(htons(caddr.sin_port));
+}
+
+// new connection; -1 when every user slot is taken
+// TCP options fail harmlessly on AF_UNIX sockets
+void tune_socket(int csock) {
+    if (np_keepalive > 0) {
+        const int on = 1, cnt = 3, intvl = max(1, np_keepalive / 3);
+        setsockopt(csock, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+        setsockopt(csock, IPPROTO_TCP, TCP_KEEPIDLE, &np_keepalive,
+                   sizeof(np_keepalive));
+        setsockopt(csock, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl));
+        setsockopt(csock, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt));
+    }
+    if (np_user_timeout > 0) {
+        setsockopt(csock, IPPROTO_TCP, TCP_USER_TIMEOUT, &np_user_timeout,
+                   sizeof(np_user_timeout));
+    }
+}
+
+/* connection storms
+   NP_BACKLOG sets the listen() backlog (default 128), and each wakeup
+   drains the whole accept queue. NP_ACCEPT_RATE (connections per second,
+   default 0: no limit) and NP_ACCEPT_BURST (default 10) give each source
+   IP a token bucket; a connection finding it empty is reset at once,
+   before anything else is spent on it. NP_DEFER_ACCEPT (seconds) sets
+   TCP_DEFER_ACCEPT, which holds a connection back until the client sends
+   something. Clients here wait for the welcome first, so they would only
+   get it after that timeout; it is off by default. While connections are
+   being turned away, the counts of accepted, shed and over capacity
+   (server full) connections go to stderr at most once a second. */
+int np_backlog = 128, np_defer_accept = 0;
+double np_accept_rate = 0, np_accept_burst = 10;
+struct bucket {
+    double tokens;
+    uint64_t last;
+};
+const size_t kBucketsMax = 4096;
+unordered_map<uint32_t, bucket> np_buckets;
+uint64_t np_accepted = 0, np_shed = 0, np_over = 0, np_reported = 0;
+
+// whether ip (network order) may connect now; takes one of its tokens
+bool take_token(uint32_t ip) {
+    if (np_accept_rate <= 0) return true;
+    const uint64_t now = tr_now();
+    const double per_ns = np_accept_rate * 1e-9;
+    if (np_buckets.size() >= kBucketsMax) {
+        // forget full buckets, or everyone if that is not enough
+        for (auto it = np_buckets.begin(); it != np_buckets.end();) {
+            const bucket &b = it->second;
+            if (b.tokens + (now - b.last) * per_ns >= np_accept_burst)
+                it = np_buckets.erase(it);
+            else
+                ++it;
+        }
+        if (np_buckets.size() >= kBucketsMax) np_buckets.clear();
+    }
+    bucket &b = np_buckets.emplace(ip, bucket{np_accept_burst, now})
+                    .first->second;
+    b.tokens = min(np_accept_burst, b.tokens + (now - b.last) * per_ns);
+    b.last = now;
+    if (b.tokens < 1) return false;
+    b.tokens -= 1;
+    return true;
+}
+
+void report_accepts() {
+    const uint64_t now = tr_now();
+    if (now - np_reported < 1000000000) return;
+    np_reported = now;
+    ostringstream os;
+    os << "accept: " << np_accepted << " accepted, " << np_shed << " shed, "
+       << np_over << " over capacity\n";
+    const string msg = os.str();
+    write(tr_log_fd, msg.c_str(), msg.size());
+}
+
+// reset a connection turned away, without a TIME_WAIT left behind
+void shed(int csock) {
+    const struct linger reset = {1, 0};
+    setsockopt(csock, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+    close(csock);
+}
+
+int on_accept(int csock) {
+    struct sockaddr_in caddr;
+    socklen_t clen = sizeof(caddr);
+    caddr.sin_family = AF_UNSPEC;
+    getpeername(csock, (struct sockaddr *)&caddr, &clen);
+    if (caddr.sin_family == AF_INET && !take_token(caddr.sin_addr.s_addr)) {
+        ++np_shed;
+        shed(csock);
+        report_accepts();
+        return -1;
+    }
+    int uid = initialize(csock);
+    if (uid == -1) {
+        ++np_over;
+        report_accepts();
+        close(csock);
+        return -1;
+    }
+    ++np_accepted;
+    tune_socket(csock);
+    np_active[uid] = tr_now();
+    np_address[uid] = peer_address(csock);
+    // np_address[uid] = "CGILAB/511";
+    ++np_gen[uid];
+    np_eof[uid] = false;
+    np_inbuf[uid].clear();
+    np_outbox[uid].clear();
     // welcome message
-    const char welcome[] =
-        "****************************************\n"
-        "** Welcome to the information server. **\n"
-        "****************************************\n";
-    const size_t wlen = strlen(welcome);
-    while (true) {
-        memcpy(&rfds, &afds, sizeof(rfds));
-        if (select(nfds, &rfds, nullptr, nullptr, nullptr) < 0) continue;
-        if (FD_ISSET(ssock, &rfds)) {
-            csock = accept(ssock, (struct sockaddr *)&caddr, &clen);
-            FD_SET(csock, &afds);
-            // initialize
-            int uid = initialize(csock);
-            inet_ntop(AF_INET, &caddr.sin_addr, cip, INET_ADDRSTRLEN);
-            np_address[uid] =
-                string(cip) + "/" + to_string(htons(caddr.sin_port));
-            // np_address[uid] = "CGILAB/511";
-            // welcome message
-            write(csock, welcome, wlen);
-            // broadcast login
-            string msg = "*** User '(no name)' entered from " +
-                         np_address[uid] + ". ***\n";
-            broadcast(msg);
+    send_to(uid, welcome);
+    // broadcast login
+    string msg =
+        "*** User '(no name)' entered from " + np_address[uid] + ". ***\n";
+    broadcast(msg);
+    // prompt
+    send_to(uid, "% ");
+    if (np_uring) uring_recv(uid);
+    return uid;
+}
+
+void logout(int uid) {
+    const int sock = np_user[uid];
+    // broadcast logout
+    string msg = "*** User '" + np_name[uid] + "' left. ***\n";
+    broadcast(msg);
+    // cleanup shell
+    shutdown(sock, SHUT_RDWR);
+    close(sock);
+    terminate(uid);
+    np_inbuf[uid].clear();
+    np_outbox[uid].clear();
+    // restore stdfd
+    for (size_t i = 0; i < 3; ++i) dup2(stdfd[i], i);
+}
+
+// run the next complete line buffered for uid; false once the user has
+// left
+bool run_lines(int uid) {
+    if (np_uring) uring_drain(uid);
+    np_current = uid;
+    bool alive = true;
+    string &in = np_inbuf[uid];
+    const size_t end = in.find('\n');
+    if (end != string::npos) {
+        int ret = npshell(uid, in.substr(0, end));
+        in.erase(0, end + 1);
+        if (ret == -1) {
+            logout(uid);
+            alive = false;
+        } else if (!np_batch[uid] || in.find('\n') == string::npos) {
             // prompt
-            write(csock, "% ", 2);
-        }
-        for (int sock = 0; sock < nfds; ++sock) {
-            if (sock != ssock && FD_ISSET(sock, &rfds)) {
-                // map sock -> uid
-                int uid = -1;
-                for (size_t i = 0; i < 30; ++i) {
-                    if (np_user[i] == sock) {
-                        uid = i;
-                        break;
-                    }
-                }
-                // npshell
-                int ret = npshell(uid);
-                if (ret == -1) {
-                    // broadcast logout
-                    string msg = "*** User '" + np_name[uid] + "' left. ***\n";
-                    broadcast(msg);
-                    // cleanup shell
-                    shutdown(sock, SHUT_RDWR);
-                    close(sock);
-                    FD_CLR(sock, &afds);
-                    terminate(uid);
-                    // restore stdfd
-                    for (size_t i = 0; i < 3; ++i) dup2(stdfd[i], i);
-                } else {
-                    // prompt
-                    write(sock, "% ", 2);
-                }
+            const uint64_t t = tr_now();
+            send_to(uid, "% ");
+            tr_record(TR_WRITE, t);
+        }
+        tr_end();
+    }
+    np_current = -1;
+    return alive;
+}
+
+// the client closed its end; lines it sent before still run
+void on_eof(int uid) {
+    if (np_uring) uring_drain(uid);
+    np_current = uid;
+    write(np_user[uid], "\n", 1);
+    logout(uid);
+    np_current = -1;
+}
+
+// bytes read from a user's socket, n == 0 at EOF; false when there is
+// nothing more to read
+bool on_input(int uid, const char *buf, size_t n) {
+    if (n == 0) {
+        np_eof[uid] = true;
+        if (np_inbuf[uid].find('\n') == string::npos) on_eof(uid);
+        return false;
+    }
+    np_active[uid] = tr_now();
+    np_inbuf[uid].append(buf, n);
+    return true;
+}
+
+/* fair scheduling
+   Input is only buffered when it arrives. Each pass of an event loop
+   starts one line per user with a complete one, from a rotating first
+   user, so a user pasting a long script takes turns with the others
+   instead of holding the server until it is done. Returns whether lines
+   are still queued, in which case the loop polls without blocking. */
+bool run_queued() {
+    static int first = 0;
+    bool queued = false;
+    for (int i = 0; i < 30; ++i) {
+        const int uid = (first + i) % 30;
+        if (np_user[uid] == -1 || np_inbuf[uid].find('\n') == string::npos)
+            continue;
+        if (!run_lines(uid)) continue;
+        if (np_inbuf[uid].find('\n') != string::npos)
+            queued = true;
+        else if (np_eof[uid])
+            on_eof(uid);
+    }
+    first = (first + 1) % 30;
+    return queued;
+}
+
+void evict(int uid) {
+    if (np_uring) uring_drain(uid);
+    const string msg = "*** Idle timeout. ***\n";
+    write(np_user[uid], msg.data(), msg.size());
+    np_current = uid;
+    logout(uid);
+    np_current = -1;
+}
+
+// log out users idle for NP_IDLE_TIMEOUT; ns until the next one could be,
+// or -1 when nobody can
+int64_t evict_idle() {
+    if (np_idle_ns == 0) return -1;
+    const uint64_t now = tr_now();
+    int64_t wait = -1;
+    for (int uid = 0; uid < 30; ++uid) {
+        if (np_user[uid] == -1) continue;
+        const uint64_t deadline = np_active[uid] + np_idle_ns;
+        if (deadline <= now) {
+            evict(uid);
+        } else if (wait == -1 || int64_t(deadline - now) < wait) {
+            wait = deadline - now;
+        }
+    }
+    return wait;
+}
+
+// set by SIGHUP, which is only delivered while an event loop waits; the
+// loops then return to main() to restart
+volatile sig_atomic_t np_restart = 0;
+void request_restart(int sig) { np_restart = 1; }
+
+void select_loop(const vector<int> &lsocks) {
+    const int nfds = min(getdtablesize(), FD_SETSIZE);
+    fd_set rfds;
+    char buf[4096];
+    while (!np_restart) {
+        const bool queued = run_queued();
+        const int64_t idle = sooner(evict_idle(), reap_doomed()),
+                      wait = queued ? 0 : idle;
+        FD_ZERO(&rfds);
+        for (int lsock : lsocks) FD_SET(lsock, &rfds);
+        for (int uid = 0; uid < 30; ++uid)
+            if (np_user[uid] != -1 && !np_eof[uid]) FD_SET(np_user[uid], &rfds);
+        const struct timespec ts = {time_t(wait / 1000000000),
+                                    long(wait % 1000000000)};
+        if (pselect(nfds, &rfds, nullptr, nullptr, wait < 0 ? nullptr : &ts,
+                    &np_sigmask) <= 0)
+            continue;
+        for (int lsock : lsocks) {
+            if (!FD_ISSET(lsock, &rfds)) continue;
+            // the whole queue per wakeup
+            while (true) {
+                const int csock =
+                    accept4(lsock, nullptr, nullptr, SOCK_CLOEXEC);
+                if (csock != -1)
+                    on_accept(csock);
+                else if (errno != EINTR && errno != ECONNABORTED)
+                    break;
+            }
+        }
+        for (int uid = 0; uid < 30; ++uid) {
+            const int sock = np_user[uid];
+            if (sock == -1 || !FD_ISSET(sock, &rfds)) continue;
+            ssize_t n = read(sock, buf, sizeof(buf));
+            if (n == -1 && errno == EINTR) continue;
+            on_input(uid, buf, max(n, ssize_t(0)));
+        }
+    }
+}
+
+/* io_uring backend (NP_IO_URING=1)
+   Multishot accept on the listening socket, one recv per client from a
+   group of provided buffers, output coalesced per user into one in-flight
+   send (MSG_WAITALL keeps order without link chains), and IORING_OP_WAITID
+   to reap children. Everything queued while handling completions goes to
+   the kernel in one io_uring_enter. */
+enum { UD_ACCEPT = 1, UD_RECV, UD_SEND, UD_PROVIDE, UD_WAITID, UD_CANCEL };
+const int kOpWaitid = 50;  // IORING_OP_WAITID, Linux 6.7
+const unsigned kBufGroup = 1, kBufCount = 64, kBufLen = 4096;
+char np_rbuf[kBufCount][kBufLen];
+siginfo_t np_siginfo;
+struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries, queued;
+    // requests submitted and not finished
+    unsigned inflight;
+    bool accept_multishot;
+    // io_uring_enter takes a timeout (Linux 5.11)
+    bool ext_arg;
+    // tearing down: finish what completes, start nothing new
+    bool quiesce;
+    void *maps[3];
+    size_t map_len[3];
+} ring;
+// completions reaped but not yet handled
+deque<struct io_uring_cqe> np_cqes;
+
+uint64_t ud(int kind, int uid = 0) {
+    return (uint64_t(np_gen[uid]) << 16) | (uid << 3) | kind;
+}
+
+bool uring_init(unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring.fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring.fd < 0) return false;
+    set_cloexec(ring.fd, true);
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned),
+           cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sq_len = cq_len = max(sq_len, cq_len);
+    char *sq = (char *)mmap(nullptr, sq_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring.fd,
+                            IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) && sq != MAP_FAILED)
+        cq = (char *)mmap(nullptr, cq_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring.fd,
+                          IORING_OFF_CQ_RING);
+    void *sqes = mmap(nullptr, p.sq_entries * sizeof(io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring.fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        close(ring.fd);
+        return false;
+    }
+    ring.maps[0] = sq, ring.map_len[0] = sq_len;
+    ring.maps[1] = cq != sq ? cq : nullptr, ring.map_len[1] = cq_len;
+    ring.maps[2] = sqes, ring.map_len[2] = p.sq_entries * sizeof(io_uring_sqe);
+    ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    ring.sqes = (struct io_uring_sqe *)sqes;
+    ring.sq_entries = p.sq_entries;
+    ring.queued = ring.inflight = 0;
+    ring.quiesce = false;
+    ring.ext_arg = p.features & IORING_FEAT_EXT_ARG;
+    return true;
+}
+
+// timeout_ns bounds the wait (-1: none), when the kernel supports it
+int uring_enter(unsigned min_complete, int64_t timeout_ns = -1) {
+    const unsigned n = ring.queued;
+    ring.queued = 0;
+    // waiting lets SIGHUP in, like pselect()
+    int ret;
+    if (min_complete && timeout_ns >= 0 && ring.ext_arg) {
+        struct __kernel_timespec ts = {timeout_ns / 1000000000,
+                                       timeout_ns % 1000000000};
+        struct io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        arg.sigmask = uint64_t(&np_sigmask);
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = uint64_t(&ts);
+        ret = syscall(__NR_io_uring_enter, ring.fd, n, min_complete,
+                      IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                      sizeof(arg));
+    } else {
+        ret = syscall(__NR_io_uring_enter, ring.fd, n, min_complete,
+                      min_complete ? IORING_ENTER_GETEVENTS : 0,
+                      min_complete ? &np_sigmask : nullptr, _NSIG / 8);
+    }
+    // move completions off the ring so it never overflows
+    unsigned head = *ring.cq_head;
+    const unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        const struct io_uring_cqe &cqe = ring.cqes[head & *ring.cq_mask];
+        if (!(cqe.flags & IORING_CQE_F_MORE)) --ring.inflight;
+        np_cqes.push_back(cqe);
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    return ret;
+}
+
+struct io_uring_sqe *uring_sqe(uint8_t op, int fd, uint64_t user_data) {
+    unsigned tail = *ring.sq_tail;
+    if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) ==
+        ring.sq_entries) {
+        uring_enter(0);
+        tail = *ring.sq_tail;
+    }
+    const unsigned idx = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    ring.sq_array[idx] = idx;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++ring.queued;
+    ++ring.inflight;
+    return sqe;
+}
+
+// the listening socket is the payload of its accept
+void uring_accept(int lsock) {
+    struct io_uring_sqe *sqe =
+        uring_sqe(IORING_OP_ACCEPT, lsock, uint64_t(lsock) << 3 | UD_ACCEPT);
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if (ring.accept_multishot) sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+void uring_provide(unsigned bid, unsigned count) {
+    struct io_uring_sqe *sqe = uring_sqe(IORING_OP_PROVIDE_BUFFERS, count,
+                                         UD_PROVIDE);
+    sqe->addr = (uint64_t)np_rbuf[bid];
+    sqe->len = kBufLen;
+    sqe->off = bid;
+    sqe->buf_group = kBufGroup;
+}
+
+void uring_recv(int uid) {
+    struct io_uring_sqe *sqe =
+        uring_sqe(IORING_OP_RECV, np_user[uid], ud(UD_RECV, uid));
+    sqe->len = kBufLen;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = kBufGroup;
+}
+
+void uring_send(int uid) {
+    np_sendbuf[uid].swap(np_outbox[uid]);
+    np_outbox[uid].clear();
+    struct io_uring_sqe *sqe =
+        uring_sqe(IORING_OP_SEND, np_user[uid], ud(UD_SEND, uid));
+    sqe->addr = (uint64_t)np_sendbuf[uid].data();
+    sqe->len = np_sendbuf[uid].size();
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    ++np_sending[uid];
+}
+
+void uring_waitid() {
+    struct io_uring_sqe *sqe = uring_sqe(kOpWaitid, 0, UD_WAITID);
+    sqe->len = P_ALL;
+    sqe->file_index = WEXITED;
+    sqe->addr2 = (uint64_t)&np_siginfo;
+    np_waitid_armed = true;
+}
+
+void on_send(const struct io_uring_cqe &cqe) {
+    const int uid = (cqe.user_data >> 3) & 0x1f;
+    const unsigned gen = cqe.user_data >> 16;
+    --np_sending[uid];
+    string &buf = np_sendbuf[uid];
+    // a short send: put the rest back in front of what queued up since
+    if (gen == np_gen[uid] && np_user[uid] != -1 && cqe.res > 0 &&
+        size_t(cqe.res) < buf.size())
+        np_outbox[uid].insert(0, buf, cqe.res, string::npos);
+    buf.clear();
+}
+
+// before a user's command writes to its socket directly, let everything
+// queued for it reach the socket first
+void uring_drain(int uid) {
+    while (np_sending[uid] > 0) {
+        // keep other completions for the main loop
+        const size_t seen = np_cqes.size();
+        if (uring_enter(1) < 0 && errno != EINTR) break;
+        for (size_t i = seen; i < np_cqes.size();) {
+            if ((np_cqes[i].user_data & 7) == UD_SEND) {
+                on_send(np_cqes[i]);
+                np_cqes.erase(np_cqes.begin() + i);
+            } else {
+                ++i;
+            }
+        }
+    }
+    const string &out = np_outbox[uid];
+    if (!out.empty()) write(np_user[uid], out.data(), out.size());
+    np_outbox[uid].clear();
+}
+
+void on_cqe(const struct io_uring_cqe &cqe) {
+    const int uid = (cqe.user_data >> 3) & 0x1f;
+    const unsigned gen = cqe.user_data >> 16;
+    switch (cqe.user_data & 7) {
+        case UD_ACCEPT: {
+            const int lsock = cqe.user_data >> 3;
+            if (cqe.res == -EINVAL && ring.accept_multishot) {
+                // multishot accept needs Linux 5.19
+                ring.accept_multishot = false;
+                uring_accept(lsock);
+                break;
             }
+            if (cqe.res >= 0) on_accept(cqe.res);
+            if (!(cqe.flags & IORING_CQE_F_MORE) && !ring.quiesce)
+                uring_accept(lsock);
+            break;
+        }
+        case UD_RECV: {
+            const bool current = gen == np_gen[uid] && np_user[uid] != -1;
+            if (cqe.res == -ENOBUFS || cqe.res == -EINTR) {
+                if (current && !ring.quiesce) uring_recv(uid);
+                break;
+            }
+            const unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            const bool has_buf = cqe.flags & IORING_CQE_F_BUFFER;
+            if (!current || cqe.res == -ECANCELED) {
+                // nothing to do
+            } else if (ring.quiesce && cqe.res > 0) {
+                // kept for after the restart
+                np_inbuf[uid].append(np_rbuf[bid], cqe.res);
+            } else if (on_input(uid, np_rbuf[bid], max(cqe.res, 0)) &&
+                       !ring.quiesce) {
+                uring_recv(uid);
+            }
+            if (has_buf && !ring.quiesce) uring_provide(bid, 1);
+            break;
+        }
+        case UD_SEND:
+            on_send(cqe);
+            break;
+        case UD_WAITID:
+            np_waitid_armed = false;
+            if (cqe.res == 0) {
+                child_reaped(np_siginfo.si_pid);
+                if (!ring.quiesce) uring_waitid();
+            } else if (cqe.res != -ECHILD && cqe.res != -EINTR) {
+                // no IORING_OP_WAITID before Linux 6.7
+                np_waitid = false;
+            }
+            break;
+        case UD_CANCEL:
+            // IORING_ASYNC_CANCEL_ANY needs Linux 5.19; without it the
+            // requests still in flight are dropped with the ring
+            if (cqe.res == -EINVAL) ring.inflight = 0;
+            break;
+    }
+}
+
+// cancel every request and handle what completed meanwhile, so no accepted
+// socket or received byte is lost, then close the ring and write what is
+// still queued directly
+void uring_quiesce() {
+    ring.quiesce = true;
+    struct io_uring_sqe *sqe = uring_sqe(IORING_OP_ASYNC_CANCEL, -1, UD_CANCEL);
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    while (ring.inflight > 0 || !np_cqes.empty()) {
+        if (np_cqes.empty() && uring_enter(1) < 0 && errno != EINTR) break;
+        while (!np_cqes.empty()) {
+            struct io_uring_cqe cqe = np_cqes.front();
+            np_cqes.pop_front();
+            on_cqe(cqe);
         }
     }
+    np_cqes.clear();
+    close(ring.fd);
+    for (int i = 0; i < 3; ++i)
+        if (ring.maps[i] != nullptr) munmap(ring.maps[i], ring.map_len[i]);
+    np_uring = np_waitid = np_waitid_armed = false;
+    for (int uid = 0; uid < 30; ++uid) {
+        np_sending[uid] = 0;
+        np_sendbuf[uid].clear();
+        if (np_user[uid] != -1) uring_drain(uid);
+    }
+}
+
+bool uring_loop(const vector<int> &lsocks) {
+    if (!uring_init(256)) return false;
+    np_uring = true;
+    np_waitid = true;
+    ring.accept_multishot = true;
+    uring_provide(0, kBufCount);
+    for (int lsock : lsocks) uring_accept(lsock);
+    // sessions carried over a restart
+    for (int uid = 0; uid < 30; ++uid)
+        if (np_user[uid] != -1) uring_recv(uid);
+    uring_waitid();
+    while (!np_restart) {
+        const bool queued = run_queued();
+        const int64_t idle = sooner(evict_idle(), reap_doomed());
+        for (int uid = 0; uid < 30; ++uid) {
+            if (np_user[uid] != -1 && np_sending[uid] == 0 &&
+                !np_outbox[uid].empty())
+                uring_send(uid);
+        }
+        if (np_cqes.empty() && uring_enter(!queued, idle) < 0 &&
+            errno != EINTR && errno != ETIME)
+            break;
+        while (!np_cqes.empty()) {
+            struct io_uring_cqe cqe = np_cqes.front();
+            np_cqes.pop_front();
+            on_cqe(cqe);
+        }
+    }
+    uring_quiesce();
+    return true;
+}
+
+/* hot restart
+   SIGHUP execs the binary /proc/self/exe pointed to at startup, so a new
+   build installed over it takes over. Listening and client sockets, pipes
+   and children all survive exec; only the session tables are carried, in a
+   memfd whose number is passed in NP_RESTART_FD. */
+string np_exe;
+char **np_argv;
+vector<string> np_environ;
+
+void put_str(ostream &os, const string &str) {
+    os << str.size() << ' ' << str << ' ';
+}
+
+string get_str(istream &is) {
+    size_t n = 0;
+    is >> n;
+    is.get();
+    string str(n, '\0');
+    is.read(&str[0], n);
+    is.get();
+    return str;
+}
+
+// pipe fds and the pids writing to them, where they are not the defaults
+void put_pipe(ostream &os, int i, const int (&fd)[2], const deque<int> &pids) {
+    if (fd[0] == 0 && fd[1] == 1 && pids.empty()) return;
+    os << i << ' ' << fd[0] << ' ' << fd[1] << ' ' << pids.size() << ' ';
+    for (int pid : pids) os << pid << ' ';
+}
+
+bool get_pipe(istream &is, int &i, int (&fd)[2], deque<int> &pids) {
+    if (!(is >> i) || i < 0) return false;
+    size_t n = 0;
+    is >> fd[0] >> fd[1] >> n;
+    pids.resize(n);
+    for (int &pid : pids) is >> pid;
+    return true;
+}
+
+void save_sessions(ostream &os, const vector<int> &lsocks) {
+    os << lsocks.size() << ' ';
+    for (int lsock : lsocks) os << lsock << ' ';
+    for (int fd : stdfd) os << fd << ' ';
+    for (int uid = 0; uid < 30; ++uid) {
+        os << np_user[uid] << ' ';
+        if (np_user[uid] == -1) continue;
+        put_str(os, np_name[uid]);
+        put_str(os, np_address[uid]);
+        put_str(os, np_inbuf[uid]);
+        const session &s = np_sessions[uid];
+        os << s.line << ' ' << np_batch[uid] << ' '
+           << np_env[uid].size() << ' ';
+        for (const pair<const string, string> &var : np_env[uid]) {
+            put_str(os, var.first);
+            put_str(os, var.second);
+        }
+        for (int i : s.live_lines)
+            put_pipe(os, i, s.fd_table[i], s.pid_table[i]);
+        os << -1 << ' ';
+    }
+    // by sender * 30 + receiver
+    for (int i = 0; i < 30 * 30; ++i) {
+        const session &r = np_sessions[i % 30];
+        put_pipe(os, i, r.pipe_in[i / 30], r.pipe_pids[i / 30]);
+    }
+    os << -1 << ' ';
+}
+
+void load_sessions(istream &is, vector<int> &lsocks) {
+    size_t n = 0;
+    is >> n;
+    lsocks.resize(n);
+    for (int &lsock : lsocks) is >> lsock;
+    for (int &fd : stdfd) is >> fd;
+    for (int uid = 0; uid < 30; ++uid) {
+        is >> np_user[uid];
+        if (np_user[uid] == -1) continue;
+        np_free &= ~(1u << uid);
+        session &s = np_sessions[uid];
+        np_name[uid] = get_str(is);
+        np_address[uid] = get_str(is);
+        np_inbuf[uid] = get_str(is);
+        is >> s.line >> np_batch[uid] >> n;
+        while (n-- > 0) {
+            string key = get_str(is);
+            np_env[uid][key] = get_str(is);
+        }
+        int i;
+        int fd[2];
+        deque<int> pids;
+        while (get_pipe(is, i, fd, pids) && i < 2000) {
+            s.fd_table[i][0] = fd[0], s.fd_table[i][1] = fd[1];
+            s.pid_table[i].swap(pids);
+            s.live_lines.insert(i);
+        }
+    }
+    int i;
+    int fd[2];
+    deque<int> pids;
+    while (get_pipe(is, i, fd, pids) && i < 30 * 30) {
+        const int from = i / 30, to = i % 30;
+        session &r = np_sessions[to];
+        r.pipe_in[from][0] = fd[0], r.pipe_in[from][1] = fd[1];
+        r.pipe_pids[from].swap(pids);
+        r.pipes_in |= 1u << from;
+        np_sessions[from].pipes_out |= 1u << to;
+    }
+}
+
+// the fds a snapshot names survive the exec into the new image (carry),
+// which makes them close-on-exec again
+void carry_fds(const vector<int> &lsocks, bool carry) {
+    for (int fd : lsocks) set_cloexec(fd, !carry);
+    for (int fd : stdfd) set_cloexec(fd, !carry);
+    for (int uid = 0; uid < 30; ++uid) {
+        if (np_user[uid] == -1) continue;
+        set_cloexec(np_user[uid], !carry);
+        const session &s = np_sessions[uid];
+        for (int i : s.live_lines) {
+            for (int fd : s.fd_table[i])
+                if (IS_PIPE(fd)) set_cloexec(fd, !carry);
+        }
+        for (uint32_t from = s.pipes_in; from != 0; from &= from - 1) {
+            for (int fd : s.pipe_in[__builtin_ctz(from)])
+                if (IS_PIPE(fd)) set_cloexec(fd, !carry);
+        }
+    }
+}
+
+// returns only if the exec failed; the old image keeps serving
+void hot_restart(const vector<int> &lsocks) {
+    np_restart = 0;
+    // the new image would not know about them
+    reap_doomed(true);
+    for (size_t i = 0; i < 3; ++i) dup2(stdfd[i], i);
+    ostringstream os;
+    save_sessions(os, lsocks);
+    const string snapshot = os.str();
+    int fd = memfd_create("np_restart", 0);
+    const ssize_t len = snapshot.size();
+    if (fd == -1 || write(fd, snapshot.data(), len) != len) {
+        cerr << "restart: snapshot: " << strerror(errno) << endl;
+        if (fd != -1) close(fd);
+        return;
+    }
+    lseek(fd, 0, SEEK_SET);
+    // npshell() replaced environ with the last user's; use the server's
+    vector<string> env = np_environ;
+    env.push_back("NP_RESTART_FD=" + to_string(fd));
+    vector<char *> envp;
+    convert(env, envp);
+    carry_fds(lsocks, true);
+    execve(np_exe.c_str(), np_argv, &envp[0]);
+    cerr << "restart: " << np_exe << ": " << strerror(errno) << endl;
+    carry_fds(lsocks, false);
+    close(fd);
+}
+
+int main(int argc, char **argv) {
+    // hot restart
+    vector<int> lsocks;
+    for (int &sock : np_user) sock = -1;
+    const char *restart = getenv("NP_RESTART_FD");
+    if (restart != nullptr) {
+        const int fd = atoi(restart);
+        unsetenv("NP_RESTART_FD");
+        string snapshot;
+        char buf[4096];
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof(buf))) > 0) snapshot.append(buf, n);
+        close(fd);
+        istringstream is(snapshot);
+        load_sessions(is, lsocks);
+        carry_fds(lsocks, false);
+    }
+    np_argv = argv;
+    for (char **env = environ; *env != nullptr; ++env)
+        np_environ.push_back(*env);
+    char exe[4096];
+    ssize_t exe_len = readlink("/proc/self/exe", exe, sizeof(exe));
+    np_exe = exe_len > 0 ? string(exe, exe_len) : "/proc/self/exe";
+    // connection storms
+    if (const char *v = getenv("NP_BACKLOG")) np_backlog = atoi(v);
+    if (const char *v = getenv("NP_ACCEPT_RATE")) np_accept_rate = atof(v);
+    if (const char *v = getenv("NP_ACCEPT_BURST")) np_accept_burst = atof(v);
+    if (const char *v = getenv("NP_DEFER_ACCEPT")) np_defer_accept = atoi(v);
+    if (restart == nullptr) {
+        // server socket
+        int ssock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int on = 1;
+        setsockopt(ssock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        setsockopt(ssock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+        struct sockaddr_in saddr;
+        saddr.sin_family = AF_INET;
+        saddr.sin_addr.s_addr = htonl(INADDR_ANY);
+        if (argc > 1) {
+            uint16_t port;
+            stringstream ss(argv[1]);
+            ss >> port;
+            saddr.sin_port = htons(port);
+        } else {
+            saddr.sin_port = htons(5566);
+        }
+        bind(ssock, (struct sockaddr *)&saddr, sizeof(saddr));
+        listen(ssock, np_backlog);
+        if (np_defer_accept > 0) {
+            setsockopt(ssock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &np_defer_accept,
+                       sizeof(np_defer_accept));
+        }
+        lsocks.push_back(ssock);
+        int usock = unix_listener(np_backlog);
+        if (usock != -1) lsocks.push_back(usock);
+        // initialize
+        for (size_t i = 0; i < 3; ++i) stdfd[i] = fcntl(i, F_DUPFD_CLOEXEC, 0);
+    }
+    // listeners never block, so a wakeup can drain the queue
+    for (int lsock : lsocks)
+        fcntl(lsock, F_SETFL, fcntl(lsock, F_GETFL) | O_NONBLOCK);
+    // tracing
+    tr_log_fd = stdfd[2];
+    const char *slow_ms = getenv("NP_TRACE_SLOW_MS");
+    if (slow_ms != nullptr) tr_slow_ns = atof(slow_ms) * 1e6;
+    struct sigaction sa_dump;
+    sa_dump.sa_handler = &tr_dump;
+    sigemptyset(&sa_dump.sa_mask);
+    sa_dump.sa_flags = SA_RESTART;
+    sigaction(SIGUSR2, &sa_dump, nullptr);
+    // a client leaving mid-write must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    // SIGHUP restarts, but only from the event loops' waits
+    struct sigaction sa_hup;
+    sa_hup.sa_handler = &request_restart;
+    sigemptyset(&sa_hup.sa_mask);
+    sa_hup.sa_flags = SA_RESTART;
+    sigaction(SIGHUP, &sa_hup, nullptr);
+    sigset_t hup;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    sigprocmask(SIG_BLOCK, &hup, &np_sigmask);
+    sigdelset(&np_sigmask, SIGHUP);
+    // dead peers and idle sessions
+    if (const char *v = getenv("NP_KEEPALIVE")) np_keepalive = atoi(v);
+    if (const char *v = getenv("NP_USER_TIMEOUT")) np_user_timeout = atoi(v);
+    if (const char *v = getenv("NP_IDLE_TIMEOUT")) np_idle_ns = atof(v) * 1e9;
+    // fd hygiene
+    if (const char *v = getenv("NP_FD_CHECK")) np_fd_check = atoi(v) != 0;
+    // teardown
+    if (const char *v = getenv("NP_KILL_GRACE"))
+        np_kill_grace_ns = atof(v) * 1e6;
+    // output cache
+    cache_init();
+    // per-session cgroups, reopened for sessions carried over a restart
+    cg_init();
+    for (int uid = 0; uid < 30; ++uid) {
+        if (np_user[uid] == -1) continue;
+        np_active[uid] = tr_now();
+        cg_open(uid);
+    }
+    // event loop
+    const char *uring = getenv("NP_IO_URING");
+    const bool use_uring = uring != nullptr && strcmp(uring, "1") == 0;
+    while (true) {
+        if (!use_uring || !uring_loop(lsocks)) select_loop(lsocks);
+        if (!np_restart) break;
+        hot_restart(lsocks);
+    }
     for (int fd : stdfd) close(fd);
 }